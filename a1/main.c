@@ -2,261 +2,2304 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
-
-#define MAX_STATES 100
-#define MAX_ALPHABET_SIZE 100
-#define MAX_STATE_LENGTH 10
-#define MAX_INPUT_LENGTH 10
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/// the arena behind an NFA grows in blocks of this size, larger tables get a block of their own
+#define ARENA_BLOCK_BYTES (1u << 20)
+/// the precomputed successor bitsets are only built when they fit in this many bytes,
+/// larger automata fall back to walking the transition table edge by edge
+#ifndef MAX_ROW_TABLE_BYTES
+#define MAX_ROW_TABLE_BYTES (64u << 20)
+#endif
+/// bytes read from the input at a time by the streaming modes
+#define STREAM_BUFFER_BYTES (64u << 10)
+/// size of the buffer the trace is written through
+#define TRACE_BUFFER_BYTES (1u << 20)
+/// binary trace files start with this magic and version
+#define TRACE_FILE_MAGIC "NFT1"
+#define TRACE_FILE_VERSION 1
+/// words a batch worker takes from a slice at a time
+#define BATCH_GRAIN 64
+/// default memory cap of the lazy DFA cache, can be changed with -M
+#ifndef LAZY_DFA_CACHE_BYTES
+#define LAZY_DFA_CACHE_BYTES (32u << 20)
+#endif
+/// compiled DFA files start with this magic and version, bump the version whenever DFAFileHeader changes
+#define DFA_FILE_MAGIC "NFA1"
+#define DFA_FILE_VERSION 1
+#define DFA_FILE_BYTE_ORDER 0x01020304u
 /// Function epsilonClosure computes all the possible currentstates we could be in.
 /// Meaning that if we are now in q1 and q1 has an epsilon transition to q2, we could be either in q1 or q2 at this moment.
+/// The closure of every state only depends on the automaton, so buildClosureTable computes it once at load time.
+
+
 
 
+/// Arena: everything the loaded automaton owns is carved out of a list of big blocks and
+/// released in one shot by freeArena, so there is no limit on the number or length of names.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
 
+typedef struct {
+    ArenaBlock* head; /// the block new allocations come from
+} Arena;
 
+/// states and symbols are stored by id, see NameTable
 typedef struct {
-    char currentState[MAX_STATE_LENGTH];
-    char inputSymbol[MAX_INPUT_LENGTH];
-    char nextState[MAX_STATE_LENGTH];
+    int currentState;
+    int inputSymbol;
+    int nextState;
 } NFATransition;
 
+/// NameTable interns strings into dense integer ids (0, 1, 2, ...) so the simulation can work with
+/// array indices instead of comparing state and symbol names with strcmp on every step.
+typedef struct {
+    Arena* arena;    /// where the names and the table itself are allocated
+    int count;
+    int capacity;
+    int bucketCount; /// always a power of two, kept at least twice as large as count
+    int* buckets;    /// open addressing, each bucket holds an id or -1 when empty
+    char** names;
+} NameTable;
+
+/// A set of states is a bitset with one bit per state id, numWords words long.
+typedef unsigned long long StateWord;
+#define WORD_BITS 64
+
 typedef struct {
+    Arena arena; /// owns every table below, freeNFA releases them all at once
     int numStates;
     int numTransitions;
-    char startState[MAX_STATE_LENGTH];
-    char acceptState[MAX_STATE_LENGTH];
-    NFATransition transitions[MAX_STATES];
+    NFATransition* transitions;
+
+    /// Interned form of the automaton, filled in by loadNFA and buildTransitionTable. After that the NFA
+    /// is read-only: the simulations take a const NFA* and keep their state sets to themselves, so
+    /// any number of them can share one automaton.
+    NameTable stateIds;  /// the listed states get ids 0..numStates-1, states only named in transitions come after
+    NameTable symbolIds; /// id EPSILON_ID is always the epsilon symbol "e"
+    int* listedStateIds; /// id of the i-th listed state, used to print the states in the order they were given
+    int startId;
+    int acceptId;
+    /// Compressed sparse row table with one row per (state, symbol) pair that has transitions, so it grows
+    /// with the number of transitions and not with states x symbols. The rows of state s are
+    /// stateRows[s] .. stateRows[s + 1] - 1, sorted by symbol (the epsilon row, if any, comes first).
+    /// Row r holds the transitions on symbol rowSymbol[r], their targets are
+    /// nextIds[rowStart[r]] .. nextIds[rowStart[r + 1] - 1]. findRow looks a pair up.
+    int numRows;
+    int* stateRows;
+    /// rowOf[s * symbolIds.count + a] is the row of s on a or -1, a direct index for findRow,
+    /// NULL when the table would be larger than MAX_ROW_TABLE_BYTES
+    int* rowOf;
+    int* rowSymbol;
+    int* rowStart;
+    int* nextIds;
+    int numWords; /// length of a state set bitset
+    /// successorRows + r * numWords is the set of states reachable through row r, epsilon closure
+    /// included, NULL when the table would be larger than MAX_ROW_TABLE_BYTES
+    StateWord* successorRows;
+    /// closureRows + closureOf[s] * numWords is the epsilon closure of s. States on an epsilon cycle have the
+    /// same closure, so they share one row (closureOf is the strongly connected component of s).
+    /// closureRows is NULL when the table would be larger than MAX_ROW_TABLE_BYTES
+    int* closureOf;
+    StateWord* closureRows;
 } NFA;
 
+#define EPSILON_ID 0
 
-void printStates(NFA nfa, char** currentStates, int numCurrentStates, char nameOfStates[MAX_STATES][MAX_STATE_LENGTH]) {
-    /// nameOfStates was added in case the states provided are not like "q[number]"
-    for (int i = 0; i < nfa.numStates; i++) {
-        int isActive = 0;
-        for (int j = 0; j < numCurrentStates; j++) {
+static inline int testState(const StateWord* set, int id) {
+    return (set[id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+}
 
-            if (currentStates[j] != NULL && strcmp(currentStates[j], nameOfStates[i]) == 0) { /// if the state i is in the
-                    /// current states vector, then it is active
-                isActive = 1;
-                break;
-            }
-        }
-        printf("%d ", isActive);
+static inline void addState(StateWord* set, int id) {
+    set[id / WORD_BITS] |= 1ULL << (id % WORD_BITS);
+}
+
+/// the row of the transitions leaving state on symbol, -1 when there are none
+static inline int findRow(const NFA* nfa, int state, int symbol) {
+    if (nfa->rowOf != NULL)
+        return nfa->rowOf[(size_t)state * nfa->symbolIds.count + symbol];
+
+    int low = nfa->stateRows[state], high = nfa->stateRows[state + 1];
+
+    while (low < high) { /// binary search, a state has few rows and they are sorted by symbol
+        int middle = low + (high - low) / 2;
+        if (nfa->rowSymbol[middle] < symbol)
+            low = middle + 1;
+        else
+            high = middle;
     }
-    printf("\n");
+    return low < nfa->stateRows[state + 1] && nfa->rowSymbol[low] == symbol ? low : -1;
 }
 
-void epsilonClosure(NFA nfa, char** states, int* numStates) {
-    int changed = 1;  // Flag to check if any changes were made in this iteration
+/// the targets of the epsilon-transitions leaving state are nextIds[*begin] .. nextIds[*end - 1]
+static inline void epsilonEdges(const NFA* nfa, int state, int* begin, int* end) {
+    int row = nfa->stateRows[state]; /// EPSILON_ID is the smallest symbol, its row is the first one
+    if (row < nfa->stateRows[state + 1] && nfa->rowSymbol[row] == EPSILON_ID) {
+        *begin = nfa->rowStart[row];
+        *end = nfa->rowStart[row + 1];
+    } else {
+        *begin = *end = 0;
+    }
+}
 
-    while (changed) { /// we need to compute in depth, meaning we can have q1->e->q2, q2->e->q3, q3-e->q4
-            /// and our next states has to be [q1,q2,q3,q4], so every iteration that still had changes, we
-            /// travel on the new possible e-transitions
-        changed = 0;
+/// dst |= src, four (AVX2) or two (SSE2) words per instruction when the compiler targets them
+void unionStates(StateWord* dst, const StateWord* src, int numWords) {
+    int w = 0;
+#ifdef __AVX2__
+    for (; w + 4 <= numWords; w += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + w));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + w));
+        _mm256_storeu_si256((__m256i*)(dst + w), _mm256_or_si256(a, b));
+    }
+#endif
+#ifdef __SSE2__
+    for (; w + 2 <= numWords; w += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + w));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + w));
+        _mm_storeu_si128((__m128i*)(dst + w), _mm_or_si128(a, b));
+    }
+#endif
+    for (; w < numWords; w++)
+        dst[w] |= src[w];
+}
 
-        for (int i = 0; i < *numStates; i++) {
-            char* currentState = states[i]; /// for every state is the states vector, we will consume epsilon-transitions
+/// the first bytes of a block that are free, allocations are 16 byte aligned for the SIMD loads
+static size_t alignArena(size_t bytes) {
+    return (bytes + 15) & ~(size_t)15;
+}
 
-            for (int j = 0; j < nfa.numTransitions; j++) {
-                NFATransition transition = nfa.transitions[j];
+void initArena(Arena* arena) {
+    arena->head = NULL;
+}
 
-                if (!strcmp(transition.currentState, currentState) &&
-                    !strcmp(transition.inputSymbol, "e")) { /// we travel on all possible epsilon-transitions from the current state
+/// returns bytes of uninitialized memory owned by arena, or NULL when the system is out of memory
+void* arenaAlloc(Arena* arena, size_t bytes) {
+    bytes = alignArena(bytes > 0 ? bytes : 1);
+    ArenaBlock* head = arena->head;
 
-                    char* nextState = transition.nextState;
-                    int alreadyAdded = 0;
+    if (head != NULL && head->size - head->used >= bytes) {
+        void* memory = head->data + head->used;
+        head->used += bytes;
+        return memory;
+    }
+
+    size_t size = bytes > ARENA_BLOCK_BYTES / 4 ? bytes : ARENA_BLOCK_BYTES;
+    ArenaBlock* block = malloc(alignArena(sizeof(ArenaBlock)) + size);
+    if (block == NULL)
+        return NULL;
+    block->size = size;
+    block->used = bytes;
+    if (size == bytes && head != NULL) { /// a big table fills its own block, keep using the current one
+        block->next = head->next;
+        head->next = block;
+    } else {
+        block->next = head;
+        arena->head = block;
+    }
+    return block->data;
+}
 
-                    // Check if nextState is already in states
-                    for (int k = 0; k < *numStates; k++) {
-                        if (!strcmp(states[k], nextState)) {
-                            alreadyAdded = 1;
-                            break;
-                        }
-                    } /// same as in the inAccepted function, we add the states reacheable by epsilon to nextStates
+void* arenaCalloc(Arena* arena, size_t bytes) {
+    void* memory = arenaAlloc(arena, bytes);
+    if (memory != NULL)
+        memset(memory, 0, bytes);
+    return memory;
+}
+
+/// arrays that keep growing (the transitions, the name tables) double their size through here, an array
+/// that was the last allocation of the current block simply grows in place
+void* arenaGrow(Arena* arena, void* old, size_t oldBytes, size_t newBytes) {
+    ArenaBlock* head = arena->head;
+    if (old != NULL && head != NULL && (char*)old + alignArena(oldBytes) == head->data + head->used &&
+        (size_t)((char*)old - head->data) + alignArena(newBytes) <= head->size) {
+        head->used = (char*)old - head->data + alignArena(newBytes);
+        return old;
+    }
+    void* memory = arenaAlloc(arena, newBytes);
+    if (memory != NULL && old != NULL)
+        memcpy(memory, old, oldBytes);
+    return memory;
+}
+
+char* arenaStrdup(Arena* arena, const char* str) {
+    size_t bytes = strlen(str) + 1;
+    char* copy = arenaAlloc(arena, bytes);
+    if (copy != NULL)
+        memcpy(copy, str, bytes);
+    return copy;
+}
 
-                    if (!alreadyAdded) {
+void freeArena(Arena* arena) {
+    while (arena->head != NULL) {
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+static unsigned int hashName(const char* name) {
+    unsigned int hash = 2166136261u; /// FNV-1a
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/// false when the system is out of memory
+bool initNameTable(NameTable* table, Arena* arena) {
+    table->arena = arena;
+    table->count = 0;
+    table->capacity = 16;
+    table->bucketCount = 32;
+    table->names = arenaAlloc(arena, sizeof(char*) * table->capacity);
+    table->buckets = arenaAlloc(arena, sizeof(int) * table->bucketCount);
+    if (table->names == NULL || table->buckets == NULL)
+        return false;
+    memset(table->buckets, -1, sizeof(int) * table->bucketCount);
+    return true;
+}
+
+/// returns the id of name, or -1 if it was never interned
+int lookupName(const NameTable* table, const char* name) {
+    unsigned int mask = table->bucketCount - 1;
+    for (unsigned int b = hashName(name) & mask; table->buckets[b] != -1; b = (b + 1) & mask) {
+        if (!strcmp(table->names[table->buckets[b]], name))
+            return table->buckets[b];
+    }
+    return -1;
+}
 
-                        states[*numStates] = (char*)malloc(sizeof(char) * MAX_INPUT_LENGTH);
-                        strcpy(states[*numStates], nextState);
-                        (*numStates)++;
-                        changed = 1;
-                    }
+/// returns the id of name, giving it the next free id if it is not in the table yet,
+/// or -1 when the system is out of memory
+int internName(NameTable* table, const char* name) {
+    int id = lookupName(table, name);
+    if (id != -1)
+        return id;
+
+    if (table->count == table->capacity) {
+        char** names = arenaGrow(table->arena, table->names, sizeof(char*) * table->capacity,
+                                 sizeof(char*) * table->capacity * 2);
+        if (names == NULL)
+            return -1;
+        table->names = names;
+        table->capacity *= 2;
+    }
+    char* copy = arenaStrdup(table->arena, name);
+    if (copy == NULL)
+        return -1;
+    if (2 * (table->count + 1) > table->bucketCount) { /// keep the load factor under 1/2, rehash everything
+        int* buckets = arenaAlloc(table->arena, sizeof(int) * table->bucketCount * 2);
+        if (buckets == NULL)
+            return -1;
+        table->bucketCount *= 2;
+        table->buckets = buckets;
+        memset(table->buckets, -1, sizeof(int) * table->bucketCount);
+        for (int i = 0; i < table->count; i++) {
+            unsigned int b = hashName(table->names[i]) & (table->bucketCount - 1);
+            while (table->buckets[b] != -1)
+                b = (b + 1) & (table->bucketCount - 1);
+            table->buckets[b] = i;
+        }
+    }
+
+    id = table->count++;
+    table->names[id] = copy;
+    unsigned int mask = table->bucketCount - 1;
+    unsigned int b = hashName(name) & mask;
+    while (table->buckets[b] != -1)
+        b = (b + 1) & mask;
+    table->buckets[b] = id;
+    return id;
+}
+
+/// Splits the epsilon-transition graph into strongly connected components with Tarjan's algorithm, written
+/// with an explicit stack since Thompson-built NFAs have epsilon chains thousands of states long.
+/// Components are numbered in the order Tarjan finishes them, so every component reachable from
+/// component c has a smaller number than c. Returns the number of components, -1 when out of memory.
+static int condenseEpsilonGraph(const NFA* nfa, int* componentOf) {
+    int numIds = nfa->stateIds.count;
+    int* order = malloc(sizeof(int) * ((size_t)numIds + 1));     /// discovery index of each state, -1 if unvisited
+    int* low = malloc(sizeof(int) * ((size_t)numIds + 1));
+    int* tarjanStack = malloc(sizeof(int) * ((size_t)numIds + 1));
+    int* callStack = malloc(sizeof(int) * ((size_t)numIds + 1)); /// states whose edges are being explored
+    int* nextEdge = malloc(sizeof(int) * ((size_t)numIds + 1));  /// next epsilon edge to explore for each state on callStack
+    int* lastEdge = malloc(sizeof(int) * ((size_t)numIds + 1));  /// end of its epsilon edges
+    int numOrdered = 0, tarjanTop = 0, numComponents = 0;
+
+    if (order == NULL || low == NULL || tarjanStack == NULL || callStack == NULL || nextEdge == NULL ||
+        lastEdge == NULL) {
+        numComponents = -1;
+        goto done;
+    }
+    for (int s = 0; s < numIds; s++) {
+        order[s] = -1;
+        componentOf[s] = -1;
+    }
+
+    for (int root = 0; root < numIds; root++) {
+        if (order[root] != -1)
+            continue;
+        int callTop = 0;
+        callStack[callTop++] = root;
+        order[root] = low[root] = numOrdered++;
+        epsilonEdges(nfa, root, &nextEdge[root], &lastEdge[root]);
+        tarjanStack[tarjanTop++] = root;
+
+        while (callTop > 0) {
+            int s = callStack[callTop - 1];
+
+            if (nextEdge[s] < lastEdge[s]) {
+                int t = nfa->nextIds[nextEdge[s]++];
+                if (order[t] == -1) { /// tree edge, "recurse" into t
+                    order[t] = low[t] = numOrdered++;
+                    epsilonEdges(nfa, t, &nextEdge[t], &lastEdge[t]);
+                    tarjanStack[tarjanTop++] = t;
+                    callStack[callTop++] = t;
+                } else if (componentOf[t] == -1 && order[t] < low[s]) { /// t is still on the Tarjan stack
+                    low[s] = order[t];
                 }
+                continue;
+            }
+
+            /// every edge of s explored, s is the root of a component if nothing below it reached higher
+            if (low[s] == order[s]) {
+                int member;
+                do {
+                    member = tarjanStack[--tarjanTop];
+                    componentOf[member] = numComponents;
+                } while (member != s);
+                numComponents++;
             }
+            callTop--;
+            if (callTop > 0 && low[s] < low[callStack[callTop - 1]])
+                low[callStack[callTop - 1]] = low[s];
         }
     }
+
+done:
+    free(order);
+    free(low);
+    free(tarjanStack);
+    free(callStack);
+    free(nextEdge);
+    free(lastEdge);
+    return numComponents;
+}
+
+/// Computes the epsilon closure of every state once: the closure of a component is its own states plus the
+/// closures of the components it has an epsilon-transition to, and those are always finished before it.
+/// Returns false when the system is out of memory. The table itself is optional: when it does not fit, or
+/// cannot be allocated, closureRows stays NULL and epsilonClosure follows the edges instead.
+bool buildClosureTable(NFA* nfa) {
+    int numIds = nfa->stateIds.count;
+
+    nfa->closureRows = NULL;
+    nfa->closureOf = arenaAlloc(&nfa->arena, sizeof(int) * ((size_t)numIds + 1));
+    if (nfa->closureOf == NULL)
+        return false;
+    int numComponents = condenseEpsilonGraph(nfa, nfa->closureOf);
+    if (numComponents == -1)
+        return false;
+
+    if ((size_t)numComponents * nfa->numWords * sizeof(StateWord) > MAX_ROW_TABLE_BYTES)
+        return true; /// epsilonClosure falls back to following the edges
+
+    /// group the states by component (counting sort) so the components can be merged in order
+    int* memberStart = calloc((size_t)numComponents + 1, sizeof(int));
+    int* members = malloc(sizeof(int) * ((size_t)numIds + 1));
+    int* fill = malloc(sizeof(int) * ((size_t)numComponents + 1));
+    nfa->closureRows = arenaCalloc(&nfa->arena, sizeof(StateWord) * ((size_t)numComponents * nfa->numWords + 1));
+    if (memberStart == NULL || members == NULL || fill == NULL || nfa->closureRows == NULL) {
+        free(memberStart); /// the table is optional, do without it
+        free(members);
+        free(fill);
+        nfa->closureRows = NULL;
+        return true;
+    }
+    for (int s = 0; s < numIds; s++)
+        memberStart[nfa->closureOf[s] + 1]++;
+    for (int c = 0; c < numComponents; c++)
+        memberStart[c + 1] += memberStart[c];
+    memcpy(fill, memberStart, sizeof(int) * ((size_t)numComponents + 1));
+    for (int s = 0; s < numIds; s++)
+        members[fill[nfa->closureOf[s]]++] = s;
+
+    for (int c = 0; c < numComponents; c++) {
+        StateWord* row = nfa->closureRows + (size_t)c * nfa->numWords;
+
+        for (int m = memberStart[c]; m < memberStart[c + 1]; m++) {
+            int s = members[m], begin, end;
+
+            addState(row, s);
+            epsilonEdges(nfa, s, &begin, &end);
+            for (int k = begin; k < end; k++) {
+                int target = nfa->closureOf[nfa->nextIds[k]];
+                if (target != c) /// target < c, its closure is already complete
+                    unionStates(row, nfa->closureRows + (size_t)target * nfa->numWords, nfa->numWords);
+            }
+        }
+    }
+
+    free(memberStart);
+    free(members);
+    free(fill);
+    return true;
 }
 
+/// Reads whitespace separated tokens of any length into a buffer that is reused for every token
+typedef struct {
+    char* text;
+    size_t capacity;
+} Token;
+
+static bool isSeparator(int c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
 
-bool isAccepted(NFA nfa, char input[100][10], int inputLen, char nameOfStates[MAX_STATES][MAX_STATE_LENGTH]) {
-    char* currentStates[MAX_STATES];
-    int numCurrentStates = 1;
-    currentStates[0] = (char*)malloc(sizeof(char) * MAX_STATE_LENGTH); // Allocate memory for the start state
-    strcpy(currentStates[0], nfa.startState); /// We start travelling the NFA from the start state
-    epsilonClosure(nfa, currentStates, &numCurrentStates); /// If the start states has epsilon transitions
-    /// the currentstates vector will be composed of [startState + states reacheable by epsilon trans]
+/// false when the system is out of memory, the token keeps the text it had
+static bool appendToToken(Token* token, size_t length, char c) {
+    if (length + 1 >= token->capacity) {
+        size_t capacity = token->capacity ? 2 * token->capacity : 64;
+        char* text = realloc(token->text, capacity);
+        if (text == NULL)
+            return false;
+        token->text = text;
+        token->capacity = capacity;
+    }
+    token->text[length] = c;
+    return true;
+}
 
-    for (int i = 0; i < inputLen; i++) { /// we iterate through every input symbol
+bool readToken(FILE* file, Token* token) {
+    int c;
+    size_t length = 0;
 
-        char* nextStates[MAX_STATES]; /// we need to know which states we will be in after consuming the current symbol
-        int numNextStates = 0;
+    do
+        c = getc(file);
+    while (isSeparator(c));
+    for (; c != EOF && !isSeparator(c); c = getc(file)) {
+        if (!appendToToken(token, length++, (char)c))
+            return false;
+    }
+    if (length == 0)
+        return false;
+    token->text[length] = '\0';
+    return true;
+}
 
-        printf("%s ", input[i]);
+/// SymbolReader reads the input symbols from a file descriptor through one reusable buffer, so a stream of
+/// any length is consumed in constant memory (plus the longest symbol). A symbol may span two reads.
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t length;   /// bytes in buffer
+    size_t position; /// next byte to look at
+    bool failed;     /// a read error, or running out of memory, ended the stream early
+    Token token;     /// the last symbol read
+} SymbolReader;
+
+void initSymbolReader(SymbolReader* reader, int fd) {
+    reader->fd = fd;
+    reader->buffer = malloc(STREAM_BUFFER_BYTES);
+    reader->length = reader->position = 0;
+    reader->failed = false;
+    reader->token.text = NULL;
+    reader->token.capacity = 0;
+}
 
-        for (int j = 0; j < numCurrentStates; j++) {
-            char* currentState = currentStates[j]; /// we iterate through every current state, because, at the moment
-            /// we can be in any of the current states
+void freeSymbolReader(SymbolReader* reader) {
+    free(reader->buffer);
+    free(reader->token.text);
+}
 
-            for (int k = 0; k < nfa.numTransitions; k++) {
-                NFATransition transition = nfa.transitions[k];
+/// next byte of the stream, EOF at the end
+static int readStreamByte(SymbolReader* reader) {
+    if (reader->position == reader->length) {
+        ssize_t bytes;
+        do
+            bytes = read(reader->fd, reader->buffer, STREAM_BUFFER_BYTES);
+        while (bytes == -1 && errno == EINTR);
+        if (bytes <= 0) {
+            reader->failed = bytes == -1;
+            return EOF;
+        }
+        reader->length = bytes;
+        reader->position = 0;
+    }
+    return (unsigned char)reader->buffer[reader->position++];
+}
 
-                if (!strcmp(transition.currentState, currentState) &&
-                    (!strcmp(transition.inputSymbol, input[i]))) { /// for every non-epsilon transition, we consume the symbol
-                        /// and add the transition next state to our next states set(unique values)
+/// reads the next symbol into reader->token, false at the end of the stream
+bool nextSymbol(SymbolReader* reader) {
+    int c;
+    size_t length = 0;
+
+    do
+        c = readStreamByte(reader);
+    while (isSeparator(c));
+    for (; c != EOF && !isSeparator(c); c = readStreamByte(reader)) {
+        if (!appendToToken(&reader->token, length++, (char)c)) {
+            reader->failed = true;
+            return false;
+        }
+    }
+    if (length == 0)
+        return false;
+    reader->token.text[length] = '\0';
+    return true;
+}
 
-                    char* nextState = transition.nextState;
-                    //printf("%s %s %s", nextState, transition.inputSymbol, currentState);
-                    int alreadyAdded = 0;
+static bool readCount(FILE* file, Token* token, long* count) {
+    char* end;
+    if (!readToken(file, token))
+        return false;
+    *count = strtol(token->text, &end, 10);
+    return *end == '\0' && *count >= 0;
+}
 
-                    for (int l = 0; l < numNextStates; l++) {
-                        if (!strcmp(nextStates[l], nextState)) { ///  make sure we don't add the same state twice
-                            alreadyAdded = 1;
-                            break;
-                        }
-                    }
+/// Load phase: reads the NFA file and interns every state and symbol name while reading, so the names are
+/// stored once no matter how many transitions use them. The input word is returned in input (its symbols
+/// are allocated in the NFA arena), or skipped when input is NULL. Nothing has a fixed size, only memory
+/// limits the automaton and the word.
+bool loadNFA(FILE* inputFile, NFA* nfa, char*** input, long* inputLen) {
+    Token token = {NULL, 0};
+    long count;
+    bool ok = false;
+
+    initArena(&nfa->arena);
+    nfa->numTransitions = 0;
+    nfa->transitions = NULL;
+    if (input != NULL) {
+        *input = NULL;
+        *inputLen = 0;
+    }
+    if (!initNameTable(&nfa->stateIds, &nfa->arena) || !initNameTable(&nfa->symbolIds, &nfa->arena) ||
+        internName(&nfa->symbolIds, "e") != EPSILON_ID)
+        goto done;
+
+    if (!readCount(inputFile, &token, &count))
+        goto done;
+    for (long i = 0; i < count; i++) { /// alphabet
+        if (!readToken(inputFile, &token))
+            goto done;
+        if (internName(&nfa->symbolIds, token.text) == -1)
+            goto done;
+    }
 
-                    if (!alreadyAdded) {
-                        nextStates[numNextStates] = (char*)malloc(sizeof(char) * MAX_STATE_LENGTH); // Allocate memory for nextState
-                        strcpy(nextStates[numNextStates], nextState);
-                        numNextStates++;
-                    } /// we add the transition's next state to our next states
-                }
-            }
+    // Read the number of states and list
+    if (!readCount(inputFile, &token, &count) || count > 0x7fffffff)
+        goto done;
+    nfa->numStates = (int)count;
+    nfa->listedStateIds = arenaAlloc(&nfa->arena, sizeof(int) * (count + 1));
+    if (nfa->listedStateIds == NULL)
+        goto done;
+    for (int i = 0; i < nfa->numStates; i++) {
+        if (!readToken(inputFile, &token))
+            goto done;
+        if ((nfa->listedStateIds[i] = internName(&nfa->stateIds, token.text)) == -1)
+            goto done;
+    }
 
+    // Read start state and accept state
+    if (!readToken(inputFile, &token))
+        goto done;
+    if ((nfa->startId = internName(&nfa->stateIds, token.text)) == -1)
+        goto done;
+    if (!readToken(inputFile, &token))
+        goto done;
+    if ((nfa->acceptId = internName(&nfa->stateIds, token.text)) == -1)
+        goto done;
+
+    // Read input string, the array doubles as needed instead of trusting the declared length
+    long inputCapacity = 0;
+    if (!readCount(inputFile, &token, &count))
+        goto done;
+    for (long i = 0; i < count; i++) {
+        if (!readToken(inputFile, &token))
+            goto done;
+        if (input == NULL)
+            continue;
+        if (*inputLen == inputCapacity) {
+            long newCapacity = inputCapacity ? 2 * inputCapacity : 64;
+            *input = arenaGrow(&nfa->arena, *input, sizeof(char*) * inputCapacity, sizeof(char*) * newCapacity);
+            if (*input == NULL)
+                goto done;
+            inputCapacity = newCapacity;
+        }
+        if (((*input)[(*inputLen)++] = arenaStrdup(&nfa->arena, token.text)) == NULL)
+            goto done;
+    }
+
+    // Read the transitions, they may use states and symbols that were not listed,
+    // those still take part in the simulation
+    int transitionCapacity = 0;
+    if (!readCount(inputFile, &token, &count) || count > 0x7fffffff)
+        goto done;
+    for (long i = 0; i < count; i++) {
+        NFATransition transition;
+        if (!readToken(inputFile, &token))
+            goto done;
+        transition.currentState = internName(&nfa->stateIds, token.text);
+        if (!readToken(inputFile, &token))
+            goto done;
+        transition.inputSymbol = internName(&nfa->symbolIds, token.text);
+        if (!readToken(inputFile, &token))
+            goto done;
+        transition.nextState = internName(&nfa->stateIds, token.text);
+        if (transition.currentState == -1 || transition.inputSymbol == -1 || transition.nextState == -1)
+            goto done;
+
+        if (nfa->numTransitions == transitionCapacity) {
+            int newCapacity = transitionCapacity ? 2 * transitionCapacity : 64;
+            nfa->transitions = arenaGrow(&nfa->arena, nfa->transitions, sizeof(NFATransition) * transitionCapacity,
+                                         sizeof(NFATransition) * newCapacity);
+            if (nfa->transitions == NULL)
+                goto done;
+            transitionCapacity = newCapacity;
         }
-        epsilonClosure(nfa, nextStates, &numNextStates); /// for all the states reached with the current symbol, we
-        /// calculate epsilon closure, meaning we can be in any of the [nextStates + states reacheable with epsilon-trans
-        /// from any of the next states].
+        nfa->transitions[nfa->numTransitions++] = transition;
+    }
+    ok = true;
 
+done:
+    free(token.text);
+    return ok;
+}
 
-        // Free memory for the previous currentStates
-        for (int j = 0; j < numCurrentStates; j++) {
-            free(currentStates[j]);
+/// Groups the transitions by (state, symbol) into the rows of the CSR table, so a simulation step only
+/// looks at the edges leaving active states, then builds the closure and successor bitset tables. The
+/// table takes time and memory linear in states + symbols + transitions. Returns false when the system is
+/// out of memory, the optional tables (rowOf, closureRows, successorRows) are left out instead when they
+/// cannot be allocated.
+bool buildTransitionTable(NFA* nfa) {
+    int numIds = nfa->stateIds.count;
+    int numSymbols = nfa->symbolIds.count;
+    int numTransitions = nfa->numTransitions;
+    const NFATransition* transitions = nfa->transitions;
+
+    /// two stable counting sorts, by symbol and then by state, order the transitions by (state, symbol)
+    int* bySymbol = malloc(sizeof(int) * ((size_t)numTransitions + 1));
+    int* byState = malloc(sizeof(int) * ((size_t)numTransitions + 1));
+    int* next = calloc((size_t)(numIds > numSymbols ? numIds : numSymbols) + 1, sizeof(int));
+    if (bySymbol == NULL || byState == NULL || next == NULL) {
+        free(bySymbol);
+        free(byState);
+        free(next);
+        return false;
+    }
+    for (int i = 0; i < numTransitions; i++)
+        next[transitions[i].inputSymbol + 1]++;
+    for (int a = 0; a < numSymbols; a++) /// prefix sum turns the counts into offsets
+        next[a + 1] += next[a];
+    for (int i = 0; i < numTransitions; i++)
+        bySymbol[next[transitions[i].inputSymbol]++] = i;
+    memset(next, 0, sizeof(int) * ((size_t)numIds + 1));
+    for (int i = 0; i < numTransitions; i++)
+        next[transitions[i].currentState + 1]++;
+    for (int s = 0; s < numIds; s++)
+        next[s + 1] += next[s];
+    for (int k = 0; k < numTransitions; k++)
+        byState[next[transitions[bySymbol[k]].currentState]++] = bySymbol[k];
+    free(bySymbol);
+    free(next);
+
+    /// a row starts wherever the (state, symbol) pair changes
+    int numRows = 0;
+    for (int k = 0; k < numTransitions; k++) {
+        const NFATransition* t = &transitions[byState[k]];
+        if (k == 0 || t->currentState != transitions[byState[k - 1]].currentState ||
+            t->inputSymbol != transitions[byState[k - 1]].inputSymbol)
+            numRows++;
+    }
+    nfa->numRows = numRows;
+    nfa->stateRows = arenaCalloc(&nfa->arena, sizeof(int) * ((size_t)numIds + 1));
+    nfa->rowSymbol = arenaAlloc(&nfa->arena, sizeof(int) * ((size_t)numRows + 1));
+    nfa->rowStart = arenaAlloc(&nfa->arena, sizeof(int) * ((size_t)numRows + 1));
+    nfa->nextIds = arenaAlloc(&nfa->arena, sizeof(int) * ((size_t)numTransitions + 1));
+    if (nfa->stateRows == NULL || nfa->rowSymbol == NULL || nfa->rowStart == NULL || nfa->nextIds == NULL) {
+        free(byState);
+        return false;
+    }
+
+    int row = -1;
+    for (int k = 0; k < numTransitions; k++) {
+        const NFATransition* t = &transitions[byState[k]];
+        if (row == -1 || t->currentState != transitions[byState[k - 1]].currentState ||
+            t->inputSymbol != transitions[byState[k - 1]].inputSymbol) {
+            row++;
+            nfa->rowSymbol[row] = t->inputSymbol;
+            nfa->rowStart[row] = k;
+            nfa->stateRows[t->currentState + 1]++;
         }
+        nfa->nextIds[k] = t->nextState;
+    }
+    nfa->rowStart[numRows] = numTransitions;
+    for (int s = 0; s < numIds; s++)
+        nfa->stateRows[s + 1] += nfa->stateRows[s];
+    free(byState);
+
+    nfa->rowOf = NULL;
+    size_t numCells = (size_t)numIds * numSymbols;
+    if (numCells * sizeof(int) <= MAX_ROW_TABLE_BYTES) {
+        nfa->rowOf = arenaAlloc(&nfa->arena, sizeof(int) * (numCells + 1));
+        if (nfa->rowOf != NULL)
+            memset(nfa->rowOf, -1, sizeof(int) * numCells);
+        for (int s = 0; s < numIds && nfa->rowOf != NULL; s++) {
+            for (int r = nfa->stateRows[s]; r < nfa->stateRows[s + 1]; r++)
+                nfa->rowOf[(size_t)s * numSymbols + nfa->rowSymbol[r]] = r;
+        }
+    }
+
+    nfa->numWords = (numIds + WORD_BITS - 1) / WORD_BITS;
+    if (!buildClosureTable(nfa))
+        return false;
+
+    /// one bitset per row so a step is an OR of rows instead of an edge walk, the rows already hold the
+    /// closure of the targets, so no epsilon-transition has to be followed after the step
+    nfa->successorRows = NULL;
+    if (nfa->closureRows != NULL && (size_t)numRows * nfa->numWords * sizeof(StateWord) <= MAX_ROW_TABLE_BYTES) {
+        nfa->successorRows = arenaCalloc(&nfa->arena, sizeof(StateWord) * ((size_t)numRows * nfa->numWords + 1));
+        for (int r = 0; r < numRows && nfa->successorRows != NULL; r++) {
+            for (int k = nfa->rowStart[r]; k < nfa->rowStart[r + 1]; k++)
+                unionStates(nfa->successorRows + (size_t)r * nfa->numWords,
+                            nfa->closureRows + (size_t)nfa->closureOf[nfa->nextIds[k]] * nfa->numWords, nfa->numWords);
+        }
+    }
+    return true;
+}
+
+void freeNFA(NFA* nfa) {
+    freeArena(&nfa->arena);
+}
+
+
+/// Tracing of the active states is opt-in (-t): TRACE_FINAL records the states after the last symbol,
+/// TRACE_SAMPLED after every `every`-th symbol and TRACE_FULL after every symbol, which is the classic
+/// "symbol 0 1 0 1" output. Rows go through one large buffer, as text to stdout or, with -o, bit-packed
+/// to a binary file: a header (magic, version, number of listed states) followed by one record per
+/// traced step, the step number as a uint64_t and one bit per listed state, lowest bit first.
+typedef enum {
+    TRACE_OFF,
+    TRACE_FINAL,
+    TRACE_SAMPLED,
+    TRACE_FULL
+} TraceLevel;
 
-        // Update currentStates to nextStates
-        numCurrentStates = numNextStates;
-        for (int j = 0; j < numCurrentStates; j++) { /// our next states are now the current states for the next iteration
-            currentStates[j] = nextStates[j];
+typedef struct {
+    TraceLevel level;
+    long long every;
+    FILE* file;        /// stdout for the text trace, the trace file for the binary one
+    bool binary;
+    char* buffer;
+    size_t length;
+} Trace;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t numStates;
+    uint32_t reserved;
+} TraceFileHeader;
+
+static void flushTrace(Trace* trace) {
+    fwrite(trace->buffer, 1, trace->length, trace->file);
+    trace->length = 0;
+}
 
+static void writeTrace(Trace* trace, const void* data, size_t bytes) {
+    if (trace->length + bytes > TRACE_BUFFER_BYTES)
+        flushTrace(trace);
+    if (bytes > TRACE_BUFFER_BYTES) { /// a huge symbol name, no point copying it
+        fwrite(data, 1, bytes, trace->file);
+        return;
+    }
+    memcpy(trace->buffer + trace->length, data, bytes);
+    trace->length += bytes;
+}
+
+void initTrace(Trace* trace, TraceLevel level, long long every, FILE* binaryFile, const NFA* nfa) {
+    trace->level = level;
+    trace->every = every;
+    trace->binary = binaryFile != NULL;
+    trace->file = binaryFile != NULL ? binaryFile : stdout;
+    trace->buffer = level != TRACE_OFF ? malloc(TRACE_BUFFER_BYTES) : NULL;
+    trace->length = 0;
+    if (trace->binary && level != TRACE_OFF) {
+        TraceFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_FILE_MAGIC, 4);
+        header.version = TRACE_FILE_VERSION;
+        header.numStates = nfa->numStates;
+        writeTrace(trace, &header, sizeof(header));
+    }
+}
+
+void freeTrace(Trace* trace) {
+    if (trace->buffer != NULL)
+        flushTrace(trace);
+    free(trace->buffer);
+}
 
+/// one row: the states are printed (or packed) in the order they were listed in the input file
+static void printStates(const NFA* nfa, const StateWord* currentStates, Trace* trace, long long step,
+                        const char* symbol) {
+    if (trace->binary) {
+        uint64_t stepNumber = step;
+        unsigned char packed[64];
+        writeTrace(trace, &stepNumber, sizeof(stepNumber));
+        for (int i = 0; i < nfa->numStates; i += 8 * (int)sizeof(packed)) {
+            memset(packed, 0, sizeof(packed));
+            int count = nfa->numStates - i < 8 * (int)sizeof(packed) ? nfa->numStates - i : 8 * (int)sizeof(packed);
+            for (int j = 0; j < count; j++)
+                packed[j / 8] |= testState(currentStates, nfa->listedStateIds[i + j]) << (j % 8);
+            writeTrace(trace, packed, (count + 7) / 8);
         }
+        return;
+    }
+
+    if (symbol != NULL) {
+        writeTrace(trace, symbol, strlen(symbol));
+        writeTrace(trace, " ", 1);
+    }
+    for (int i = 0; i < nfa->numStates; i++)
+        writeTrace(trace, testState(currentStates, nfa->listedStateIds[i]) ? "1 " : "0 ", 2);
+    writeTrace(trace, "\n", 1);
+}
+
+/// called with the active states after step symbols were consumed, the last one being symbol
+static inline void traceStep(const NFA* nfa, const StateWord* currentStates, Trace* trace, long long step,
+                             const char* symbol) {
+    if (trace->level == TRACE_FULL || (trace->level == TRACE_SAMPLED && step % trace->every == 0))
+        printStates(nfa, currentStates, trace, step, symbol);
+}
 
-        printStates(nfa, currentStates, numCurrentStates, nameOfStates); /// print the active states after consuming the symbol input[i]
+/// called once at the end of the input, flushes the trace so it comes before the verdict
+void traceEnd(const NFA* nfa, const StateWord* currentStates, Trace* trace, long long step, const char* symbol) {
+    if (trace->level == TRACE_FINAL)
+        printStates(nfa, currentStates, trace, step, symbol);
+    if (trace->buffer != NULL)
+        flushTrace(trace);
+    fflush(trace->file);
+}
 
+void epsilonClosure(const NFA* nfa, StateWord* states, int* pending) {
+    if (nfa->closureRows != NULL) {
+        /// the closure of a set is the union of the precomputed closures of its states, the bits an OR adds
+        /// are already closed, so visiting them too is harmless
+        for (int w = 0; w < nfa->numWords; w++) {
+            for (StateWord bits = states[w]; bits; bits &= bits - 1) {
+                int state = w * WORD_BITS + __builtin_ctzll(bits);
+                unionStates(states, nfa->closureRows + (size_t)nfa->closureOf[state] * nfa->numWords, nfa->numWords);
+            }
+        }
+        return;
     }
 
-    bool isAccepted = false;
-    for (int i = 0; i < numCurrentStates; i++) {
-        if (!strcmp(currentStates[i], nfa.acceptState)) { /// deciding if we accept the input when we have reached the end of it
-            isAccepted = true; /// if we are currently(end of input) in the accept state, then we consider that the word is accepted
-            break;
+    /// pending is a stack of states whose epsilon-transitions we still have to follow, every state added to
+    /// the set is pushed once, so chains like q1->e->q2, q2->e->q3, q3-e->q4 end up as [q1,q2,q3,q4] in a single pass.
+    int numPending = 0;
+
+    for (int w = 0; w < nfa->numWords; w++) {
+        for (StateWord bits = states[w]; bits; bits &= bits - 1)
+            pending[numPending++] = w * WORD_BITS + __builtin_ctzll(bits);
+    }
+
+    while (numPending > 0) {
+        int begin, end;
+        epsilonEdges(nfa, pending[--numPending], &begin, &end); /// we travel on all possible epsilon-transitions
+
+        for (int k = begin; k < end; k++) {
+            int nextState = nfa->nextIds[k];
+
+            if (!testState(states, nextState)) { /// a state already in the set was already pushed
+                addState(states, nextState);
+                pending[numPending++] = nextState;
+            }
+        }
+    }
+}
+
+/// nextStates = every state reachable from currentStates by consuming symbol, epsilon closure included
+void stepStates(const NFA* nfa, const StateWord* currentStates, StateWord* nextStates, int symbol, int* pending) {
+    memset(nextStates, 0, sizeof(StateWord) * nfa->numWords);
+    if (symbol == -1) /// no transition uses this symbol
+        return;
+
+    for (int w = 0; w < nfa->numWords; w++) {
+        for (StateWord bits = currentStates[w]; bits; bits &= bits - 1) { /// only the active states
+            int row = findRow(nfa, w * WORD_BITS + __builtin_ctzll(bits), symbol);
+
+            if (row == -1) {
+                continue;
+            } else if (nfa->successorRows != NULL) {
+                unionStates(nextStates, nfa->successorRows + (size_t)row * nfa->numWords, nfa->numWords);
+            } else {
+                for (int k = nfa->rowStart[row]; k < nfa->rowStart[row + 1]; k++)
+                    addState(nextStates, nfa->nextIds[k]);
+            }
         }
     }
+
+    if (nfa->successorRows == NULL) /// the rows are closed already, the edge walk is not
+        epsilonClosure(nfa, nextStates, pending);
+}
+
+
+bool isAccepted(const NFA* nfa, char** input, long inputLen, Trace* trace) {
+    /// both sets are allocated once, a step only ORs bits into them
+    StateWord* currentStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+    StateWord* nextStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+    int* pending = malloc(sizeof(int) * (nfa->stateIds.count + 1));
+
+    addState(currentStates, nfa->startId); /// We start travelling the NFA from the start state
+    epsilonClosure(nfa, currentStates, pending); /// If the start states has epsilon transitions
+    /// the currentstates set will be composed of [startState + states reacheable by epsilon trans]
+
+    for (long i = 0; i < inputLen; i++) { /// we iterate through every input symbol
+        /// we need to know which states we will be in after consuming the current symbol, that is
+        /// the [nextStates + states reacheable with epsilon-trans from any of the next states].
+        stepStates(nfa, currentStates, nextStates, lookupName(&nfa->symbolIds, input[i]), pending);
+
+        // Swap currentStates and nextStates, our next states are now the current states for the next iteration
+        StateWord* tmp = currentStates;
+        currentStates = nextStates;
+        nextStates = tmp;
+
+        traceStep(nfa, currentStates, trace, i + 1, input[i]); /// the active states after consuming the symbol input[i]
+    }
+    traceEnd(nfa, currentStates, trace, inputLen, inputLen > 0 ? input[inputLen - 1] : NULL);
+
+    /// if we are currently(end of input) in the accept state, then we consider that the word is accepted
     /// otherwise, it is rejected
+    bool isAccepted = testState(currentStates, nfa->acceptId);
 
-    // Free memory for the final currentStates
-    for (int i = 0; i < numCurrentStates; i++) {
-        free(currentStates[i]);
+    free(currentStates);
+    free(nextStates);
+    free(pending);
+
+    return isAccepted;
+}
+
+/// LazyDFA determinizes the NFA on the fly: every set of active states reached gets a DFA state id and the
+/// (DFA state, symbol) -> DFA state transitions are remembered, so a step that was seen before is one lookup.
+/// The cache never grows over maxStates states, when it is full everything is flushed and rebuilt from the
+/// current set, which keeps pathological automata (exponentially many sets) from using all the memory.
+typedef struct {
+    const NFA* nfa;
+    int numWords;
+    int numSymbols;
+    int count;
+    int capacity;    /// states currently allocated
+    int maxStates;   /// states allowed by the memory cap
+    int bucketCount; /// hash table from state sets to ids, power of two, at least twice capacity
+    int* buckets;
+    StateWord* sets; /// sets + id * numWords is the NFA state set of DFA state id
+    int* next;       /// next[id * numSymbols + symbol] is the DFA state reached, or -1 if not computed yet
+    StateWord* scratch;
+    int* pending;
+    long flushes;
+    bool capped;     /// the cache could not grow, maxStates was lowered to the states allocated
+} LazyDFA;
+
+static unsigned int hashStates(const StateWord* set, int numWords) {
+    unsigned long long hash = 0x9E3779B97F4A7C15ULL;
+    for (int w = 0; w < numWords; w++) {
+        hash ^= set[w];
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
     }
+    return (unsigned int)hash;
+}
 
+static void placeLazyState(LazyDFA* dfa, int id) {
+    unsigned int mask = dfa->bucketCount - 1;
+    unsigned int b = hashStates(dfa->sets + (size_t)id * dfa->numWords, dfa->numWords) & mask;
+    while (dfa->buckets[b] != -1)
+        b = (b + 1) & mask;
+    dfa->buckets[b] = id;
+}
+
+void freeLazyDFA(LazyDFA* dfa) {
+    free(dfa->buckets);
+    free(dfa->sets);
+    free(dfa->next);
+    free(dfa->scratch);
+    free(dfa->pending);
+}
+
+/// returns false when there is no memory even for the first states, nothing is left to free then
+bool initLazyDFA(LazyDFA* dfa, const NFA* nfa, size_t cacheBytes) {
+    dfa->nfa = nfa;
+    dfa->numWords = nfa->numWords;
+    dfa->numSymbols = nfa->symbolIds.count;
+    /// bytes used by one DFA state: its set, its transitions and two hash buckets
+    size_t stateBytes = sizeof(StateWord) * dfa->numWords + sizeof(int) * (dfa->numSymbols + 2);
+    size_t maxStates = cacheBytes / stateBytes;
+    dfa->maxStates = maxStates < 2 ? 2 : (maxStates > (1 << 28) ? (1 << 28) : (int)maxStates);
+    dfa->count = 0;
+    dfa->capacity = dfa->maxStates < 64 ? dfa->maxStates : 64;
+    dfa->bucketCount = 128;
+    while (dfa->bucketCount < 2 * dfa->capacity)
+        dfa->bucketCount *= 2;
+    dfa->buckets = malloc(sizeof(int) * dfa->bucketCount);
+    dfa->sets = malloc(sizeof(StateWord) * ((size_t)dfa->capacity * dfa->numWords + 1));
+    dfa->next = malloc(sizeof(int) * ((size_t)dfa->capacity * dfa->numSymbols + 1));
+    dfa->scratch = calloc(dfa->numWords + 1, sizeof(StateWord));
+    dfa->pending = malloc(sizeof(int) * (nfa->stateIds.count + 1));
+    dfa->flushes = 0;
+    dfa->capped = false;
+    if (dfa->buckets == NULL || dfa->sets == NULL || dfa->next == NULL || dfa->scratch == NULL ||
+        dfa->pending == NULL) {
+        freeLazyDFA(dfa);
+        memset(dfa, 0, sizeof(LazyDFA));
+        return false;
+    }
+    memset(dfa->buckets, -1, sizeof(int) * dfa->bucketCount);
+    return true;
+}
+
+/// doubles the cache towards the cap, returns false and leaves it as it was when there is no memory for that
+static bool growLazyDFA(LazyDFA* dfa) {
+    int capacity = dfa->capacity > dfa->maxStates / 2 ? dfa->maxStates : 2 * dfa->capacity;
+
+    StateWord* sets = realloc(dfa->sets, sizeof(StateWord) * ((size_t)capacity * dfa->numWords + 1));
+    if (sets == NULL)
+        return false;
+    dfa->sets = sets;
+    int* next = realloc(dfa->next, sizeof(int) * ((size_t)capacity * dfa->numSymbols + 1));
+    if (next == NULL)
+        return false;
+    dfa->next = next;
+    if (dfa->bucketCount < 2 * capacity) {
+        int bucketCount = dfa->bucketCount;
+        while (bucketCount < 2 * capacity)
+            bucketCount *= 2;
+        int* buckets = malloc(sizeof(int) * bucketCount);
+        if (buckets == NULL)
+            return false;
+        free(dfa->buckets);
+        dfa->buckets = buckets;
+        dfa->bucketCount = bucketCount;
+        memset(dfa->buckets, -1, sizeof(int) * dfa->bucketCount);
+        for (int id = 0; id < dfa->count; id++)
+            placeLazyState(dfa, id);
+    }
+    dfa->capacity = capacity;
+    return true;
+}
+
+/// returns the DFA state of set, adding it if needed. Adding to a full cache flushes it first, in that case
+/// every id handed out before is invalid and *flushed is set.
+int findOrAddLazyState(LazyDFA* dfa, const StateWord* set, bool* flushed) {
+    unsigned int mask = dfa->bucketCount - 1;
+    size_t setBytes = sizeof(StateWord) * dfa->numWords;
+
+    for (unsigned int b = hashStates(set, dfa->numWords) & mask; dfa->buckets[b] != -1; b = (b + 1) & mask) {
+        if (!memcmp(dfa->sets + (size_t)dfa->buckets[b] * dfa->numWords, set, setBytes))
+            return dfa->buckets[b];
+    }
+
+    if (dfa->count == dfa->capacity && dfa->count < dfa->maxStates && !growLazyDFA(dfa)) {
+        dfa->maxStates = dfa->count; /// no memory to grow, the cache keeps the size it has
+        dfa->capped = true;
+    }
+    if (dfa->count == dfa->maxStates) { /// over the memory cap, start over
+        dfa->count = 0;
+        dfa->flushes++;
+        memset(dfa->buckets, -1, sizeof(int) * dfa->bucketCount);
+        *flushed = true;
+    }
+
+    int id = dfa->count++;
+    memcpy(dfa->sets + (size_t)id * dfa->numWords, set, setBytes);
+    for (int a = 0; a < dfa->numSymbols; a++)
+        dfa->next[(size_t)id * dfa->numSymbols + a] = -1;
+    placeLazyState(dfa, id);
+    return id;
+}
+
+/// Makes room for `needed` new states: if they might not fit, the cache is flushed and only the states in
+/// ids are added back, ids is updated with their new numbers. Returns false when even that is not enough.
+bool reserveLazyStates(LazyDFA* dfa, int* ids, int numIds, int needed) {
+    bool flushed = false;
+
+    if (dfa->count + needed <= dfa->maxStates)
+        return true;
+    if (numIds + needed > dfa->maxStates)
+        return false;
+
+    StateWord* kept = malloc(sizeof(StateWord) * ((size_t)numIds * dfa->numWords + 1));
+    for (int i = 0; i < numIds; i++)
+        memcpy(kept + (size_t)i * dfa->numWords, dfa->sets + (size_t)ids[i] * dfa->numWords,
+               sizeof(StateWord) * dfa->numWords);
+    dfa->count = 0;
+    dfa->flushes++;
+    memset(dfa->buckets, -1, sizeof(int) * dfa->bucketCount);
+    for (int i = 0; i < numIds; i++)
+        ids[i] = findOrAddLazyState(dfa, kept + (size_t)i * dfa->numWords, &flushed);
+    free(kept);
+    return true;
+}
+
+/// the DFA state reached from state on symbol, computed with stepStates the first time only
+int lazyStep(LazyDFA* dfa, int state, int symbol) {
+    bool flushed = false;
+
+    if (symbol == -1) { /// no transition uses this symbol, we end up in the empty set
+        memset(dfa->scratch, 0, sizeof(StateWord) * dfa->numWords);
+        return findOrAddLazyState(dfa, dfa->scratch, &flushed);
+    }
+
+    size_t cell = (size_t)state * dfa->numSymbols + symbol;
+    if (dfa->next[cell] != -1)
+        return dfa->next[cell];
+
+    stepStates(dfa->nfa, dfa->sets + (size_t)state * dfa->numWords, dfa->scratch, symbol, dfa->pending);
+    int nextState = findOrAddLazyState(dfa, dfa->scratch, &flushed);
+    if (!flushed) /// after a flush state is gone, the transition is simply computed again next time
+        dfa->next[cell] = nextState;
+    return nextState;
+}
+
+/// Same result and output as isAccepted, but runs on the lazily built DFA. Returns -1 when the cache
+/// cannot be allocated.
+int isAcceptedLazy(const NFA* nfa, char** input, long inputLen, size_t cacheBytes, Trace* trace) {
+    LazyDFA dfa;
+    bool flushed = false;
+
+    if (!initLazyDFA(&dfa, nfa, cacheBytes))
+        return -1;
+    memset(dfa.scratch, 0, sizeof(StateWord) * dfa.numWords);
+    addState(dfa.scratch, nfa->startId);
+    epsilonClosure(nfa, dfa.scratch, dfa.pending);
+    int state = findOrAddLazyState(&dfa, dfa.scratch, &flushed);
+
+    for (long i = 0; i < inputLen; i++) {
+        state = lazyStep(&dfa, state, lookupName(&nfa->symbolIds, input[i]));
+        traceStep(nfa, dfa.sets + (size_t)state * dfa.numWords, trace, i + 1, input[i]);
+    }
+    traceEnd(nfa, dfa.sets + (size_t)state * dfa.numWords, trace, inputLen, inputLen > 0 ? input[inputLen - 1] : NULL);
+
+    bool isAccepted = testState(dfa.sets + (size_t)state * dfa.numWords, nfa->acceptId);
+    freeLazyDFA(&dfa);
     return isAccepted;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <NFA_input_file>\n", argv[0]);
+/// Streaming mode: simulates the NFA (or the lazy DFA when lazy is set) over the symbols read from fd,
+/// one buffer at a time, and prints the verdict at the end of the stream. With reportMatches, a
+/// "match <n>" line is printed every time the accept state becomes active after the n-th symbol.
+int streamNFA(const NFA* nfa, int fd, bool lazy, size_t cacheBytes, bool reportMatches, Trace* trace) {
+    SymbolReader reader;
+    LazyDFA dfa;
+    StateWord* currentStates = NULL;
+    StateWord* nextStates = NULL;
+    int* pending = NULL;
+    int state = 0;
+    bool flushed = false;
+
+    if (lazy && !initLazyDFA(&dfa, nfa, cacheBytes)) {
+        fprintf(stderr, "Error allocating the lazy DFA cache: out of memory\n");
         return 1;
     }
-    FILE* inputFile = fopen(argv[1], "r");
+    initSymbolReader(&reader, fd);
+    if (lazy) {
+        memset(dfa.scratch, 0, sizeof(StateWord) * dfa.numWords);
+        addState(dfa.scratch, nfa->startId);
+        epsilonClosure(nfa, dfa.scratch, dfa.pending);
+        state = findOrAddLazyState(&dfa, dfa.scratch, &flushed);
+    } else {
+        currentStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+        nextStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+        pending = malloc(sizeof(int) * (nfa->stateIds.count + 1));
+        addState(currentStates, nfa->startId);
+        epsilonClosure(nfa, currentStates, pending);
+    }
 
-    if (inputFile == NULL) {
+    long long position = 0;
+    bool wasAccepting = lazy ? testState(dfa.sets + (size_t)state * dfa.numWords, nfa->acceptId)
+                             : testState(currentStates, nfa->acceptId);
+    bool isAccepting = wasAccepting;
+
+    while (nextSymbol(&reader)) {
+        int symbol = lookupName(&nfa->symbolIds, reader.token.text);
+        position++;
+
+        if (lazy) {
+            state = lazyStep(&dfa, state, symbol);
+            isAccepting = testState(dfa.sets + (size_t)state * dfa.numWords, nfa->acceptId);
+        } else {
+            stepStates(nfa, currentStates, nextStates, symbol, pending);
+            StateWord* tmp = currentStates;
+            currentStates = nextStates;
+            nextStates = tmp;
+            isAccepting = testState(currentStates, nfa->acceptId);
+        }
 
-        perror("Error opening input file");
+        const StateWord* activeStates = lazy ? dfa.sets + (size_t)state * dfa.numWords : currentStates;
+        traceStep(nfa, activeStates, trace, position, reader.token.text);
+        if (reportMatches && isAccepting && !wasAccepting) {
+            if (trace->level != TRACE_OFF && !trace->binary)
+                flushTrace(trace); /// keep the text trace and the events in order
+            printf("match %lld\n", position);
+        }
+        wasAccepting = isAccepting;
+    }
+    traceEnd(nfa, lazy ? dfa.sets + (size_t)state * dfa.numWords : currentStates, trace, position,
+             position > 0 ? reader.token.text : NULL);
+
+    bool failed = reader.failed;
+    if (failed)
+        perror("Error reading input stream");
+    else
+        printf(isAccepting ? "accept\n" : "reject\n");
+
+    if (lazy)
+        freeLazyDFA(&dfa);
+    free(currentStates);
+    free(nextStates);
+    free(pending);
+    freeSymbolReader(&reader);
+    return failed ? 1 : 0;
+}
+
+/// Batch mode: one line of the words file is one input word. The NFA is loaded once and shared read-only by
+/// a pool of threads, every thread keeps its own state sets (or its own lazy DFA cache, capped at
+/// cacheBytes each). The words are split into one slice per thread, a thread that finishes its slice steals
+/// BATCH_GRAIN words at a time from the others. Verdicts go to an array and are printed in input order.
+typedef struct {
+    atomic_long next; /// first word of the slice nobody has taken yet
+    long end;
+} WorkSlice;
+
+typedef struct {
+    const NFA* nfa;
+    char* text;      /// the whole words file, every '\n' replaced by '\0'
+    long* wordStart; /// word w starts at text + wordStart[w]
+    long numWords;
+    char* verdicts;
+    WorkSlice* slices;
+    int numThreads;
+    bool lazy;
+    size_t cacheBytes;
+    atomic_bool failed; /// a worker could not allocate its lazy DFA cache
+} BatchJob;
+
+typedef struct {
+    BatchJob* job;
+    int id;
+} BatchWorker;
+
+/// splits the next symbol off *cursor in place, NULL at the end of the word
+static char* nextWordSymbol(char** cursor) {
+    char* symbol = *cursor;
+    while (*symbol != '\0' && isSeparator((unsigned char)*symbol))
+        symbol++;
+    if (*symbol == '\0')
+        return NULL;
+    char* end = symbol;
+    while (*end != '\0' && !isSeparator((unsigned char)*end))
+        end++;
+    *cursor = *end != '\0' ? end + 1 : end;
+    *end = '\0';
+    return symbol;
+}
+
+static void* runBatchWorker(void* arg) {
+    BatchWorker* worker = arg;
+    BatchJob* job = worker->job;
+    const NFA* nfa = job->nfa;
+    LazyDFA dfa;
+    StateWord* currentStates = NULL;
+    StateWord* nextStates = NULL;
+    int* pending = NULL;
+    int startState = 0;
+    bool flushed = false;
+
+    if (job->lazy) {
+        if (!initLazyDFA(&dfa, nfa, job->cacheBytes)) {
+            atomic_store(&job->failed, true); /// the other workers still steal this one's slice
+            return NULL;
+        }
+    } else {
+        currentStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+        nextStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+        pending = malloc(sizeof(int) * (nfa->stateIds.count + 1));
+    }
+
+    /// own slice first, then steal from the others, a slice that ran out stays empty
+    for (int tried = 0, victim = worker->id; tried < job->numThreads; ) {
+        WorkSlice* slice = &job->slices[victim];
+        long first = atomic_fetch_add(&slice->next, BATCH_GRAIN);
+        if (first >= slice->end) {
+            victim = (victim + 1) % job->numThreads;
+            tried++;
+            continue;
+        }
+        long last = first + BATCH_GRAIN < slice->end ? first + BATCH_GRAIN : slice->end;
+
+        for (long w = first; w < last; w++) {
+            char* cursor = job->text + job->wordStart[w];
+            char* symbolName;
+
+            if (job->lazy) {
+                /// the start state is looked up again in case the cache was flushed
+                memset(dfa.scratch, 0, sizeof(StateWord) * dfa.numWords);
+                addState(dfa.scratch, nfa->startId);
+                epsilonClosure(nfa, dfa.scratch, dfa.pending);
+                startState = findOrAddLazyState(&dfa, dfa.scratch, &flushed);
+                int state = startState;
+                while ((symbolName = nextWordSymbol(&cursor)) != NULL)
+                    state = lazyStep(&dfa, state, lookupName(&nfa->symbolIds, symbolName));
+                job->verdicts[w] = testState(dfa.sets + (size_t)state * dfa.numWords, nfa->acceptId);
+            } else {
+                memset(currentStates, 0, sizeof(StateWord) * nfa->numWords);
+                addState(currentStates, nfa->startId);
+                epsilonClosure(nfa, currentStates, pending);
+                while ((symbolName = nextWordSymbol(&cursor)) != NULL) {
+                    stepStates(nfa, currentStates, nextStates, lookupName(&nfa->symbolIds, symbolName), pending);
+                    StateWord* tmp = currentStates;
+                    currentStates = nextStates;
+                    nextStates = tmp;
+                }
+                job->verdicts[w] = testState(currentStates, nfa->acceptId);
+            }
+        }
+    }
+
+    if (job->lazy)
+        freeLazyDFA(&dfa);
+    free(currentStates);
+    free(nextStates);
+    free(pending);
+    return NULL;
+}
+
+/// reads the whole file into a NUL terminated buffer, NULL on error
+static char* readWholeFile(const char* fileName, long* length) {
+    int fd = open(fileName, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    char* text = malloc((size_t)info.st_size + 1);
+    long done = 0;
+    while (text != NULL && done < info.st_size) {
+        ssize_t bytes = read(fd, text + done, info.st_size - done);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        done += bytes;
+    }
+    close(fd);
+    if (text != NULL) {
+        text[done] = '\0';
+        *length = done;
+    }
+    return text;
+}
+
+int runBatch(const NFA* nfa, const char* wordsFileName, int numThreads, bool lazy, size_t cacheBytes) {
+    BatchJob job;
+    long length;
+
+    job.text = readWholeFile(wordsFileName, &length);
+    if (job.text == NULL) {
+        perror("Error reading words file");
         return 1;
     }
 
-    int alphabetSize;
-    fscanf(inputFile, "%d", &alphabetSize);
-    char alphabet[MAX_ALPHABET_SIZE][MAX_INPUT_LENGTH];
-    for (int i = 0; i < alphabetSize; i++) {
-        fscanf(inputFile, " %s", alphabet[i]);
+    /// one word per line, a last line without '\n' still counts
+    job.numWords = 0;
+    for (long i = 0; i < length; i++)
+        job.numWords += job.text[i] == '\n';
+    if (length > 0 && job.text[length - 1] != '\n')
+        job.numWords++;
+    job.wordStart = malloc(sizeof(long) * (job.numWords + 1));
+    job.verdicts = malloc(job.numWords + 1);
+    job.slices = malloc(sizeof(WorkSlice) * numThreads);
+    pthread_t* threads = malloc(sizeof(pthread_t) * numThreads);
+    BatchWorker* workers = malloc(sizeof(BatchWorker) * numThreads);
+    if (job.wordStart == NULL || job.verdicts == NULL || job.slices == NULL || threads == NULL || workers == NULL) {
+        fprintf(stderr, "Error reading words file: out of memory\n");
+        free(threads);
+        free(workers);
+        free(job.slices);
+        free(job.verdicts);
+        free(job.wordStart);
+        free(job.text);
+        return 1;
+    }
+    long word = 0;
+    for (long i = 0; i < length; i++) {
+        if (i == 0 || job.text[i - 1] == '\n')
+            job.wordStart[word++] = i;
+    }
+    for (long i = 0; i < length; i++) {
+        if (job.text[i] == '\n')
+            job.text[i] = '\0';
+    }
 
+    job.nfa = nfa;
+    job.lazy = lazy;
+    job.cacheBytes = cacheBytes;
+    job.numThreads = numThreads;
+    atomic_init(&job.failed, false);
+    for (int t = 0; t < numThreads; t++) {
+        atomic_init(&job.slices[t].next, job.numWords * t / numThreads);
+        job.slices[t].end = job.numWords * (t + 1) / numThreads;
     }
 
-    // Read the number of states and list
+    int started = 0;
+    for (int t = 0; t < numThreads; t++) {
+        workers[t].job = &job;
+        workers[t].id = t;
+    }
+    /// worker 0 runs on the calling thread, if a thread cannot be created the others steal its slice
+    for (int t = 1; t < numThreads; t++) {
+        if (pthread_create(&threads[started], NULL, runBatchWorker, &workers[t]) == 0)
+            started++;
+    }
+    runBatchWorker(&workers[0]);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    bool failed = atomic_load(&job.failed);
+    if (failed)
+        fprintf(stderr, "Error allocating the lazy DFA cache: out of memory\n");
+    for (long w = 0; w < job.numWords && !failed; w++)
+        fputs(job.verdicts[w] ? "accept\n" : "reject\n", stdout);
+
+    free(threads);
+    free(workers);
+    free(job.slices);
+    free(job.verdicts);
+    free(job.wordStart);
+    free(job.text);
+    return failed ? 1 : 0;
+}
+
+/// Parallel mode for one long word: the word is cut into one chunk per thread. The first chunk runs from
+/// the start state as usual. Every other chunk is run speculatively from each state it could start in,
+/// which is any state some transition leads to (an "entry" state), as a lane of its own on the chunk's lazy
+/// DFA. The simulation distributes over union, so the states after a chunk are the union of the lanes of
+/// the entry states active before it. Lanes that reach the same DFA state stay together from then on, so
+/// after a few symbols only a handful of lanes are left. At the end the chunks are composed in order.
+typedef struct {
+    const NFA* nfa;
+    char** input;
+    int* symbols;      /// the whole word as symbol ids, each chunk converts its own part
+    long begin;
+    long end;
+    const int* entryStates;
+    int numLanes;      /// 1 for the first chunk, the number of entry states otherwise
+    size_t cacheBytes;
+    LazyDFA dfa;       /// the lanes end in states of this cache, it is freed after the composition
+    int* laneParent;   /// union-find over the lanes, lanes that reached the same DFA state are merged
+    int* laneState;    /// the DFA state of every lane that is the root of its set
+    bool failed;       /// the cache cannot hold two states for every lane
+} ChunkJob;
+
+static int findLane(int* laneParent, int lane) {
+    while (laneParent[lane] != lane) {
+        laneParent[lane] = laneParent[laneParent[lane]];
+        lane = laneParent[lane];
+    }
+    return lane;
+}
+
+/// keeps one lane per DFA state in active (in place), returns how many are left
+static int mergeLanes(ChunkJob* job, int* active, int numActive, int* table, int tableMask) {
+    int kept = 0;
+    for (int i = 0; i < numActive; i++) {
+        int lane = active[i];
+        unsigned int b = (unsigned int)job->laneState[lane] * 2654435761u & tableMask;
+        while (table[b] != -1 && job->laneState[table[b]] != job->laneState[lane])
+            b = (b + 1) & tableMask;
+        if (table[b] == -1) {
+            table[b] = lane;
+            active[kept++] = lane;
+        } else {
+            job->laneParent[lane] = table[b];
+        }
+    }
+    for (int i = 0; i < kept; i++) { /// clear only what was used, every kept lane is still found by probing
+        unsigned int b = (unsigned int)job->laneState[active[i]] * 2654435761u & tableMask;
+        while (table[b] != active[i])
+            b = (b + 1) & tableMask;
+        table[b] = -1;
+    }
+    return kept;
+}
+
+static void* runChunk(void* arg) {
+    ChunkJob* job = arg;
+    const NFA* nfa = job->nfa;
+    bool flushed = false;
+
+    for (long i = job->begin; i < job->end; i++)
+        job->symbols[i] = lookupName(&nfa->symbolIds, job->input[i]);
+
+    job->laneParent = malloc(sizeof(int) * job->numLanes);
+    job->laneState = malloc(sizeof(int) * job->numLanes);
+    if (job->laneParent == NULL || job->laneState == NULL || !initLazyDFA(&job->dfa, nfa, job->cacheBytes) ||
+        job->dfa.maxStates < 2 * job->numLanes) {
+        job->failed = true;
+        return NULL;
+    }
+
+    int* active = malloc(sizeof(int) * job->numLanes);
+    int* activeStates = malloc(sizeof(int) * job->numLanes);
+    int tableSize = 2;
+    while (tableSize < 2 * job->numLanes)
+        tableSize *= 2;
+    int* table = malloc(sizeof(int) * tableSize);
+    if (active == NULL || activeStates == NULL || table == NULL) {
+        job->failed = true;
+        free(active);
+        free(activeStates);
+        free(table);
+        return NULL;
+    }
+    memset(table, -1, sizeof(int) * tableSize);
+
+    for (int lane = 0; lane < job->numLanes; lane++) {
+        memset(job->dfa.scratch, 0, sizeof(StateWord) * job->dfa.numWords);
+        addState(job->dfa.scratch, job->entryStates != NULL ? job->entryStates[lane] : nfa->startId);
+        epsilonClosure(nfa, job->dfa.scratch, job->dfa.pending);
+        job->laneParent[lane] = lane;
+        job->laneState[lane] = findOrAddLazyState(&job->dfa, job->dfa.scratch, &flushed);
+        active[lane] = lane;
+    }
+    int numActive = mergeLanes(job, active, job->numLanes, table, tableSize - 1);
+
+    for (long i = job->begin; i < job->end; i++) {
+        if (job->dfa.count + numActive > job->dfa.maxStates) { /// every lane may add a state
+            for (int l = 0; l < numActive; l++)
+                activeStates[l] = job->laneState[active[l]];
+            if (!reserveLazyStates(&job->dfa, activeStates, numActive, numActive)) { /// the cache was capped
+                job->failed = true;
+                break;
+            }
+            for (int l = 0; l < numActive; l++)
+                job->laneState[active[l]] = activeStates[l];
+        }
+        for (int l = 0; l < numActive; l++)
+            job->laneState[active[l]] = lazyStep(&job->dfa, job->laneState[active[l]], job->symbols[i]);
+        numActive = mergeLanes(job, active, numActive, table, tableSize - 1);
+    }
+
+    free(active);
+    free(activeStates);
+    free(table);
+    return NULL;
+}
+
+/// Returns 1 for accept, 0 for reject and -1 when a chunk cache is too small for its lanes or memory
+/// runs out, in that case the caller runs the word sequentially. finalStates receives the active states at the end.
+int isAcceptedParallel(const NFA* nfa, char** input, long inputLen, int numThreads, size_t cacheBytes,
+                       StateWord* finalStates) {
+    int numChunks = inputLen < numThreads ? (inputLen > 0 ? (int)inputLen : 1) : numThreads;
+    ChunkJob* jobs = calloc(numChunks, sizeof(ChunkJob));
+    pthread_t* threads = malloc(sizeof(pthread_t) * numChunks);
+    bool* started = calloc(numChunks, sizeof(bool));
+    int* symbols = malloc(sizeof(int) * (inputLen + 1));
+
+    /// the entry states: targets of any transition, input "e" follows epsilon-transitions too
+    char* isEntry = calloc(nfa->stateIds.count + 1, 1);
+    int* entryStates = malloc(sizeof(int) * (nfa->stateIds.count + 1));
+    StateWord* composed = calloc(nfa->numWords + 1, sizeof(StateWord));
+    if (jobs == NULL || threads == NULL || started == NULL || symbols == NULL || isEntry == NULL ||
+        entryStates == NULL || composed == NULL) {
+        free(jobs);
+        free(threads);
+        free(started);
+        free(symbols);
+        free(isEntry);
+        free(entryStates);
+        free(composed);
+        return -1;
+    }
+    int numEntries = 0;
+    for (int i = 0; i < nfa->numTransitions; i++)
+        isEntry[nfa->transitions[i].nextState] = 1;
+    for (int state = 0; state < nfa->stateIds.count; state++)
+        if (isEntry[state])
+            entryStates[numEntries++] = state;
+
+    for (int c = 0; c < numChunks; c++) {
+        jobs[c].nfa = nfa;
+        jobs[c].input = input;
+        jobs[c].symbols = symbols;
+        jobs[c].begin = inputLen * c / numChunks;
+        jobs[c].end = inputLen * (c + 1) / numChunks;
+        jobs[c].entryStates = c == 0 ? NULL : entryStates;
+        jobs[c].numLanes = c == 0 ? 1 : numEntries;
+        jobs[c].cacheBytes = cacheBytes;
+    }
+    /// chunk 0 runs on the calling thread, a chunk whose thread cannot be created runs there too
+    for (int c = 1; c < numChunks; c++)
+        started[c] = numEntries > 0 && pthread_create(&threads[c], NULL, runChunk, &jobs[c]) == 0;
+    runChunk(&jobs[0]);
+    for (int c = 1; c < numChunks; c++) {
+        if (started[c])
+            pthread_join(threads[c], NULL);
+        else if (numEntries > 0)
+            runChunk(&jobs[c]);
+    }
+
+    int verdict = 0;
+    bool failed = false;
+    for (int c = 0; c < numChunks; c++)
+        failed |= jobs[c].failed;
+
+    if (!failed) {
+        LazyDFA* first = &jobs[0].dfa;
+        memcpy(finalStates, first->sets + (size_t)jobs[0].laneState[findLane(jobs[0].laneParent, 0)] * first->numWords,
+               sizeof(StateWord) * nfa->numWords);
+        for (int c = 1; c < numChunks; c++) {
+            if (numEntries == 0) { /// no transitions at all, nothing survives a symbol
+                memset(finalStates, 0, sizeof(StateWord) * nfa->numWords);
+                break;
+            }
+            memset(composed, 0, sizeof(StateWord) * nfa->numWords);
+            for (int e = 0; e < numEntries; e++) {
+                if (testState(finalStates, entryStates[e])) {
+                    int lane = findLane(jobs[c].laneParent, e);
+                    unionStates(composed, jobs[c].dfa.sets + (size_t)jobs[c].laneState[lane] * jobs[c].dfa.numWords,
+                                nfa->numWords);
+                }
+            }
+            memcpy(finalStates, composed, sizeof(StateWord) * nfa->numWords);
+        }
+        verdict = testState(finalStates, nfa->acceptId);
+    }
+
+    for (int c = 0; c < numChunks; c++) {
+        if (c == 0 || numEntries > 0) {
+            freeLazyDFA(&jobs[c].dfa);
+            free(jobs[c].laneParent);
+            free(jobs[c].laneState);
+        }
+    }
+    free(jobs);
+    free(threads);
+    free(started);
+    free(symbols);
+    free(isEntry);
+    free(entryStates);
+    free(composed);
+    return failed ? -1 : verdict;
+}
+
+/// Minimal DFA produced by compileDFA, with the symbol ids of the NFA it was built from
+typedef struct {
     int numStates;
-    fscanf(inputFile, "%d", &numStates);
-    char states[MAX_STATES][MAX_STATE_LENGTH];
+    int numSymbols;
+    int startState;
+    int deadState; /// the state of the empty set, used for symbols no transition knows
+    int* next;     /// next[state * numSymbols + symbol]
+    char* accepting;
+} DFA;
+
+/// Hopcroft's partition refinement: starts from {accepting, rejecting} and splits blocks until every block
+/// agrees on which block each symbol leads to. Returns the number of blocks, blockOf maps states to blocks.
+static int minimizeDFA(const DFA* dfa, int* blockOf) {
+    int n = dfa->numStates, k = dfa->numSymbols;
+
+    /// inverse transitions: the states going to t on a are sources[sourceStart[t * k + a] .. sourceStart[t * k + a + 1]-1]
+    int* sourceStart = calloc((size_t)n * k + 1, sizeof(int));
+    int* sources = malloc(sizeof(int) * ((size_t)n * k + 1));
+    for (int s = 0; s < n; s++)
+        for (int a = 0; a < k; a++)
+            sourceStart[(size_t)dfa->next[(size_t)s * k + a] * k + a + 1]++;
+    for (size_t c = 0; c < (size_t)n * k; c++)
+        sourceStart[c + 1] += sourceStart[c];
+    int* fill = malloc(sizeof(int) * ((size_t)n * k + 1));
+    memcpy(fill, sourceStart, sizeof(int) * ((size_t)n * k));
+    for (int s = 0; s < n; s++)
+        for (int a = 0; a < k; a++)
+            sources[fill[(size_t)dfa->next[(size_t)s * k + a] * k + a]++] = s;
+    free(fill);
+
+    /// the states of block b are elements[first[b] .. past[b]-1], marked ones are moved to the front
+    int* elements = malloc(sizeof(int) * n);
+    int* location = malloc(sizeof(int) * n);
+    int* first = malloc(sizeof(int) * n);
+    int* past = malloc(sizeof(int) * n);
+    int* marked = calloc(n, sizeof(int));
+    int* touched = malloc(sizeof(int) * n);
+    int* splitter = malloc(sizeof(int) * n);
+    char* waiting = calloc((size_t)n * k, 1);      /// waiting[b * k + a] if (b, a) is in the worklist
+    int* worklist = malloc(sizeof(int) * ((size_t)n * k)); /// entries are b * k + a
+    int numBlocks = 0, numWaiting = 0;
+
+    int numAccepting = 0;
+    for (int s = 0; s < n; s++)
+        numAccepting += dfa->accepting[s] ? 1 : 0;
+    int front = 0, back = numAccepting;
+    for (int s = 0; s < n; s++) {
+        int pos = dfa->accepting[s] ? front++ : back++;
+        elements[pos] = s;
+        location[s] = pos;
+    }
+    if (numAccepting > 0) {
+        first[numBlocks] = 0;
+        past[numBlocks++] = numAccepting;
+    }
+    if (numAccepting < n) {
+        first[numBlocks] = numAccepting;
+        past[numBlocks++] = n;
+    }
+    for (int b = 0; b < numBlocks; b++)
+        for (int p = first[b]; p < past[b]; p++)
+            blockOf[elements[p]] = b;
+
+    /// it is enough to start with the smaller of the two blocks
+    int smallest = numBlocks == 2 && past[1] - first[1] < past[0] - first[0] ? 1 : 0;
+    for (int a = 0; a < k; a++) {
+        waiting[(size_t)smallest * k + a] = 1;
+        worklist[numWaiting++] = smallest * k + a;
+    }
+
+    while (numWaiting > 0) {
+        int entry = worklist[--numWaiting];
+        int splitBlock = entry / k, a = entry % k;
+        int splitterSize = past[splitBlock] - first[splitBlock];
+        int numTouched = 0;
+
+        waiting[entry] = 0;
+        /// copy the splitter, marking below reorders the elements of its own block
+        memcpy(splitter, elements + first[splitBlock], sizeof(int) * splitterSize);
+
+        for (int i = 0; i < splitterSize; i++) {
+            size_t cell = (size_t)splitter[i] * k + a;
+            for (int j = sourceStart[cell]; j < sourceStart[cell + 1]; j++) {
+                int s = sources[j], b = blockOf[s];
+                int markedPos = first[b] + marked[b];
+                if (location[s] < markedPos)
+                    continue; /// already marked
+                if (marked[b] == 0)
+                    touched[numTouched++] = b;
+                int other = elements[markedPos];
+                elements[markedPos] = s;
+                elements[location[s]] = other;
+                location[other] = location[s];
+                location[s] = markedPos;
+                marked[b]++;
+            }
+        }
+
+        for (int t = 0; t < numTouched; t++) {
+            int b = touched[t];
+            int numMarked = marked[b];
+            marked[b] = 0;
+            if (numMarked == past[b] - first[b])
+                continue; /// the whole block goes into the splitter, nothing to split
+
+            int c = numBlocks++; /// the marked states become block c
+            first[c] = first[b];
+            past[c] = first[b] + numMarked;
+            first[b] = past[c];
+            for (int p = first[c]; p < past[c]; p++)
+                blockOf[elements[p]] = c;
+
+            for (int x = 0; x < k; x++) {
+                if (waiting[(size_t)b * k + x]) {
+                    waiting[(size_t)c * k + x] = 1;
+                    worklist[numWaiting++] = c * k + x;
+                } else {
+                    int smaller = past[c] - first[c] <= past[b] - first[b] ? c : b;
+                    waiting[(size_t)smaller * k + x] = 1;
+                    worklist[numWaiting++] = smaller * k + x;
+                }
+            }
+        }
+    }
+
+    free(sourceStart);
+    free(sources);
+    free(elements);
+    free(location);
+    free(first);
+    free(past);
+    free(marked);
+    free(touched);
+    free(splitter);
+    free(waiting);
+    free(worklist);
+    return numBlocks;
+}
 
-    for (int i = 0; i < numStates; i++) {
-        fscanf(inputFile, "%s", states[i]);
+/// Full subset construction followed by minimization. stateLimitBytes caps the memory of the subset
+/// construction like the lazy DFA cache does. Returns 1 when done, 0 when the DFA would be larger than
+/// that and -1 when memory ran out first.
+int compileDFA(const NFA* nfa, DFA* out, size_t stateLimitBytes, int* numSubsetStates) {
+    LazyDFA lazy;
+    bool flushed = false;
+    int k = nfa->symbolIds.count;
+
+    if (!initLazyDFA(&lazy, nfa, stateLimitBytes))
+        return -1;
+    memset(lazy.scratch, 0, sizeof(StateWord) * lazy.numWords);
+    int deadState = findOrAddLazyState(&lazy, lazy.scratch, &flushed); /// unknown symbols lead here
+    addState(lazy.scratch, nfa->startId);
+    epsilonClosure(nfa, lazy.scratch, lazy.pending);
+    int startState = findOrAddLazyState(&lazy, lazy.scratch, &flushed);
+
+    /// every new set is appended, so walking the ids in order is a breadth-first search of the DFA
+    for (int id = 0; id < lazy.count && lazy.flushes == 0; id++)
+        for (int a = 0; a < k && lazy.flushes == 0; a++)
+            lazyStep(&lazy, id, a);
+    if (lazy.flushes > 0) {
+        freeLazyDFA(&lazy);
+        return lazy.capped ? -1 : 0;
     }
 
-    // Read start state and accept state
-    char startState[MAX_STATE_LENGTH]; // State names are strings
-    char acceptState[MAX_STATE_LENGTH];
-    fscanf(inputFile, "%s", startState);
-    fscanf(inputFile, "%s", acceptState);
+    DFA full;
+    full.numStates = lazy.count;
+    full.numSymbols = k;
+    full.next = lazy.next;
+    full.accepting = malloc((size_t)lazy.count + 1);
+    for (int id = 0; id < lazy.count; id++)
+        full.accepting[id] = testState(lazy.sets + (size_t)id * lazy.numWords, nfa->acceptId);
+    *numSubsetStates = lazy.count;
+
+    int* blockOf = malloc(sizeof(int) * lazy.count);
+    out->numStates = minimizeDFA(&full, blockOf);
+    out->numSymbols = k;
+    out->startState = blockOf[startState];
+    out->deadState = blockOf[deadState];
+    out->next = malloc(sizeof(int) * ((size_t)out->numStates * k + 1));
+    out->accepting = malloc((size_t)out->numStates + 1);
+    for (int id = 0; id < lazy.count; id++) { /// every state of a block behaves the same, any one will do
+        out->accepting[blockOf[id]] = full.accepting[id];
+        for (int a = 0; a < k; a++)
+            out->next[(size_t)blockOf[id] * k + a] = blockOf[full.next[(size_t)id * k + a]];
+    }
 
-    // Read input string
-    int inputStringLength;
-    char inputString[100][MAX_INPUT_LENGTH];
-    fscanf(inputFile, "%d", &inputStringLength);
+    free(blockOf);
+    free(full.accepting);
+    freeLazyDFA(&lazy);
+    return 1;
+}
 
+void freeDFA(DFA* dfa) {
+    free(dfa->next);
+    free(dfa->accepting);
+}
 
-    for(int i = 0; i<inputStringLength;i++)
-    {
-        fscanf(inputFile, " %s", inputString[i]);
+/// Layout of a compiled DFA file. All sections are arrays in host byte order, each starting at a multiple
+/// of 8 bytes from the beginning of the file, so the runner can use them straight from the mapping:
+///   next       int32_t[numStates * numSymbols]
+///   accepting  uint8_t[numStates]
+///   buckets    int32_t[bucketCount], the symbol hash table (hashName, linear probing, -1 = empty)
+///   nameStart  uint32_t[numSymbols + 1], offsets of the symbol names in names
+///   names      the symbol names, each terminated by '\0'
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder; /// DFA_FILE_BYTE_ORDER as written by the compiling machine
+    uint32_t numStates;
+    uint32_t numSymbols;
+    uint32_t startState;
+    uint32_t deadState;
+    uint32_t bucketCount;
+    uint64_t nextOffset;
+    uint64_t acceptingOffset;
+    uint64_t bucketsOffset;
+    uint64_t nameStartOffset;
+    uint64_t namesOffset;
+    uint64_t fileSize;
+} DFAFileHeader;
+
+static uint64_t alignSection(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static void writeSection(FILE* file, uint64_t offset, const void* data, size_t bytes) {
+    static const char zeros[8] = {0};
+    long padding = (long)offset - ftell(file);
+    fwrite(zeros, 1, padding, file);
+    if (bytes > 0)
+        fwrite(data, 1, bytes, file);
+}
+
+bool writeDFAFile(const char* fileName, const DFA* dfa, const NameTable* symbols) {
+    DFAFileHeader header;
+    uint32_t* nameStart = malloc(sizeof(uint32_t) * (symbols->count + 1));
+
+    nameStart[0] = 0;
+    for (int a = 0; a < symbols->count; a++)
+        nameStart[a + 1] = nameStart[a] + strlen(symbols->names[a]) + 1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DFA_FILE_MAGIC, 4);
+    header.version = DFA_FILE_VERSION;
+    header.byteOrder = DFA_FILE_BYTE_ORDER;
+    header.numStates = dfa->numStates;
+    header.numSymbols = dfa->numSymbols;
+    header.startState = dfa->startState;
+    header.deadState = dfa->deadState;
+    header.bucketCount = symbols->bucketCount;
+    header.nextOffset = alignSection(sizeof(header));
+    header.acceptingOffset = alignSection(header.nextOffset + sizeof(int32_t) * (uint64_t)dfa->numStates * dfa->numSymbols);
+    header.bucketsOffset = alignSection(header.acceptingOffset + dfa->numStates);
+    header.nameStartOffset = alignSection(header.bucketsOffset + sizeof(int32_t) * (uint64_t)symbols->bucketCount);
+    header.namesOffset = alignSection(header.nameStartOffset + sizeof(uint32_t) * (uint64_t)(symbols->count + 1));
+    header.fileSize = header.namesOffset + nameStart[symbols->count];
+
+    FILE* file = fopen(fileName, "wb");
+    if (file == NULL) {
+        free(nameStart);
+        return false;
     }
+    fwrite(&header, sizeof(header), 1, file);
+    writeSection(file, header.nextOffset, dfa->next, sizeof(int32_t) * (size_t)dfa->numStates * dfa->numSymbols);
+    writeSection(file, header.acceptingOffset, dfa->accepting, dfa->numStates);
+    writeSection(file, header.bucketsOffset, symbols->buckets, sizeof(int32_t) * symbols->bucketCount);
+    writeSection(file, header.nameStartOffset, nameStart, sizeof(uint32_t) * (symbols->count + 1));
+    writeSection(file, header.namesOffset, NULL, 0);
+    for (int a = 0; a < symbols->count; a++)
+        fwrite(symbols->names[a], 1, strlen(symbols->names[a]) + 1, file);
+
+    free(nameStart);
+    bool failed = ferror(file);
+    return fclose(file) == 0 && !failed; /// fclose flushes, a full disk shows up here
+}
 
+/// A compiled DFA file mapped into memory, the pointers point into the mapping
+typedef struct {
+    const DFAFileHeader* header;
+    const int32_t* next;
+    const uint8_t* accepting;
+    const int32_t* buckets;
+    const uint32_t* nameStart;
+    const char* names;
+    size_t mappedBytes;
+} MappedDFA;
+
+/// maps fileName and checks that the header and every section fit in the file, prints why when it fails
+bool mapDFAFile(const char* fileName, MappedDFA* dfa) {
+    int fd = open(fileName, O_RDONLY);
+    struct stat info;
+
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        perror("Error opening compiled DFA");
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    dfa->mappedBytes = info.st_size;
+    if (dfa->mappedBytes < sizeof(DFAFileHeader)) {
+        fprintf(stderr, "%s: not a compiled DFA\n", fileName);
+        close(fd);
+        return false;
+    }
+    void* base = mmap(NULL, dfa->mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /// the mapping keeps the file alive
+    if (base == MAP_FAILED) {
+        perror("Error mapping compiled DFA");
+        return false;
+    }
 
-    // Read number of transitions
-    int numTransitions;
-    fscanf(inputFile, "%d", &numTransitions);
-    NFATransition transitions[MAX_STATES];
-    for (int i = 0; i < numTransitions; i++) {
-        fscanf(inputFile, "%s %s %s",
-               transitions[i].currentState,
-               transitions[i].inputSymbol,
-               transitions[i].nextState);
+    const DFAFileHeader* header = base;
+    dfa->header = header;
+    if (memcmp(header->magic, DFA_FILE_MAGIC, 4) || header->version != DFA_FILE_VERSION ||
+        header->byteOrder != DFA_FILE_BYTE_ORDER || header->fileSize != dfa->mappedBytes ||
+        header->numStates == 0 || header->startState >= header->numStates || header->deadState >= header->numStates ||
+        header->bucketCount == 0 || (header->bucketCount & (header->bucketCount - 1)) ||
+        header->nextOffset + sizeof(int32_t) * (uint64_t)header->numStates * header->numSymbols > header->acceptingOffset ||
+        header->acceptingOffset + header->numStates > header->bucketsOffset ||
+        header->bucketsOffset + sizeof(int32_t) * (uint64_t)header->bucketCount > header->nameStartOffset ||
+        header->nameStartOffset + sizeof(uint32_t) * ((uint64_t)header->numSymbols + 1) > header->namesOffset ||
+        header->namesOffset > header->fileSize) {
+        fprintf(stderr, "%s: not a compiled DFA of version %d for this machine\n", fileName, DFA_FILE_VERSION);
+        munmap(base, dfa->mappedBytes);
+        return false;
+    }
+
+    const char* bytes = base;
+    dfa->next = (const int32_t*)(bytes + header->nextOffset);
+    dfa->accepting = (const uint8_t*)(bytes + header->acceptingOffset);
+    dfa->buckets = (const int32_t*)(bytes + header->bucketsOffset);
+    dfa->nameStart = (const uint32_t*)(bytes + header->nameStartOffset);
+    dfa->names = bytes + header->namesOffset;
+    return true;
+}
+
+void unmapDFAFile(MappedDFA* dfa) {
+    munmap((void*)dfa->header, dfa->mappedBytes);
+}
+
+/// lookupName on the symbol table stored in the file, -1 if the symbol is unknown
+int lookupMappedSymbol(const MappedDFA* dfa, const char* name) {
+    unsigned int mask = dfa->header->bucketCount - 1;
+    size_t namesBytes = dfa->header->fileSize - dfa->header->namesOffset;
 
-        //printf("%s %s %s \n", transitions[i].currentState, transitions[i].inputSymbol, transitions[i].nextState);
+    for (unsigned int b = hashName(name) & mask; dfa->buckets[b] != -1; b = (b + 1) & mask) {
+        uint32_t symbol = dfa->buckets[b];
+        if (symbol < dfa->header->numSymbols && dfa->nameStart[symbol] < namesBytes &&
+            !strncmp(dfa->names + dfa->nameStart[symbol], name, namesBytes - dfa->nameStart[symbol]))
+            return symbol;
     }
+    return -1;
+}
 
-    fclose(inputFile);
+/// Runs a compiled DFA over the whitespace separated symbols of wordFileName ("-" for stdin), one table
+/// lookup per symbol, streaming the input through a SymbolReader
+int runCompiledDFA(const char* dfaFileName, const char* wordFileName) {
+    MappedDFA dfa;
+    if (!mapDFAFile(dfaFileName, &dfa))
+        return 1;
 
+    int fd = strcmp(wordFileName, "-") ? open(wordFileName, O_RDONLY) : STDIN_FILENO;
+    if (fd == -1) {
+        perror("Error opening input file");
+        unmapDFAFile(&dfa);
+        return 1;
+    }
+
+    SymbolReader reader;
+    uint32_t numSymbols = dfa.header->numSymbols;
+    uint32_t state = dfa.header->startState;
+    bool failed = false;
+
+    initSymbolReader(&reader, fd);
+    while (!failed && nextSymbol(&reader)) {
+        int symbol = lookupMappedSymbol(&dfa, reader.token.text);
+        state = symbol == -1 ? dfa.header->deadState : (uint32_t)dfa.next[(size_t)state * numSymbols + symbol];
+        if (state >= dfa.header->numStates) { /// only a corrupted file can get here
+            fprintf(stderr, "%s: transition to a state that does not exist\n", dfaFileName);
+            failed = true;
+        }
+    }
+    if (reader.failed) {
+        perror("Error reading input file");
+        failed = true;
+    }
+    if (!failed)
+        printf(dfa.accepting[state] ? "accept\n" : "reject\n");
+
+    freeSymbolReader(&reader);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    unmapDFAFile(&dfa);
+    return failed ? 1 : 0;
+}
 
+/// isAcceptedParallel plus the final trace row, -1 if the word has to be run sequentially
+static int parallelVerdict(const NFA* nfa, char** input, long inputLen, int numThreads, size_t cacheBytes,
+                           Trace* trace) {
+    StateWord* finalStates = calloc(nfa->numWords + 1, sizeof(StateWord));
+    if (finalStates == NULL)
+        return -1;
+    int verdict = isAcceptedParallel(nfa, input, inputLen, numThreads, cacheBytes, finalStates);
+    if (verdict != -1)
+        traceEnd(nfa, finalStates, trace, inputLen, inputLen > 0 ? input[inputLen - 1] : NULL);
+    free(finalStates);
+    return verdict;
+}
 
-    // Create the NFA structure
-    NFA nfa;
-    nfa.numStates = numStates;
-    nfa.numTransitions = numTransitions;
-    strcpy(nfa.startState, startState); // Copy state names
-    strcpy(nfa.acceptState, acceptState);
+int main(int argc, char* argv[]) {
+    bool lazy = false;
+    size_t cacheBytes = LAZY_DFA_CACHE_BYTES;
+    char* compileFileName = NULL;
+    char* runFileName = NULL;
+    char* streamFileName = NULL;
+    char* batchFileName = NULL;
+    long numThreads = 0; /// 0 until -j is given
+    bool reportMatches = false;
+    bool parallel = false;
+    TraceLevel traceLevel = TRACE_OFF;
+    long long traceEvery = 1;
+    char* traceFileName = NULL;
+    int option;
+
+    /// -m nfa simulates the NFA directly (default), -m lazy runs the lazily built DFA whose cache
+    /// is capped at -M megabytes. -c compiles the NFA into a minimal DFA file (its subset construction is
+    /// capped at -M megabytes too), -r runs such a file over a file of input symbols.
+    /// -s streams the input symbols from a file (or stdin for "-") instead of using the word in the
+    /// NFA file, -e also reports every position where the accept state becomes active.
+    /// -b runs every line of a words file as its own input word on -j threads.
+    /// -t traces the active states: off (default), final, full or a number N to trace every N-th step,
+    /// -o writes that trace bit-packed to a file instead of as text to stdout.
+    /// -p splits the word into -j chunks simulated in parallel, it only supports -t off and -t final and at
+    /// least two threads, and cannot be combined with -s, -e, -b, -c or -r.
+    while ((option = getopt(argc, argv, "m:M:c:r:s:eb:j:t:o:p")) != -1) {
+        if (option == 'm' && !strcmp(optarg, "lazy")) {
+            lazy = true;
+        } else if (option == 'm' && !strcmp(optarg, "nfa")) {
+            lazy = false;
+        } else if (option == 'M' && atol(optarg) > 0) {
+            cacheBytes = (size_t)atol(optarg) << 20;
+        } else if (option == 'c') {
+            compileFileName = optarg;
+        } else if (option == 'r') {
+            runFileName = optarg;
+        } else if (option == 's') {
+            streamFileName = optarg;
+        } else if (option == 'e') {
+            reportMatches = true;
+        } else if (option == 'b') {
+            batchFileName = optarg;
+        } else if (option == 'j' && atol(optarg) > 0) {
+            numThreads = atol(optarg);
+        } else if (option == 't' && !strcmp(optarg, "off")) {
+            traceLevel = TRACE_OFF;
+        } else if (option == 't' && !strcmp(optarg, "final")) {
+            traceLevel = TRACE_FINAL;
+        } else if (option == 't' && !strcmp(optarg, "full")) {
+            traceLevel = TRACE_FULL;
+        } else if (option == 't' && atoll(optarg) > 0) {
+            traceLevel = TRACE_SAMPLED;
+            traceEvery = atoll(optarg);
+        } else if (option == 'o') {
+            traceFileName = optarg;
+        } else if (option == 'p') {
+            parallel = true;
+        } else {
+            optind = argc; /// unknown option, print the usage below
+            break;
+        }
+    }
+    if (numThreads == 0) {
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (parallel && numThreads < 2) /// one processor still gets two chunks with -p
+            numThreads = 2;
+    }
+    if (parallel && (traceLevel == TRACE_FULL || traceLevel == TRACE_SAMPLED || numThreads < 2 ||
+                     streamFileName != NULL || reportMatches || batchFileName != NULL ||
+                     compileFileName != NULL || runFileName != NULL))
+        optind = argc; /// none of these has a parallel run, print the usage instead of ignoring -p
+    if (optind != argc - 1) {
+        printf("Usage: %s [-m nfa|lazy] [-M cache_megabytes] [-t off|final|full|N] [-o trace_file] <NFA_input_file>\n"
+               "       %s -p [-j threads] [-M cache_megabytes] [-t off|final] [-o trace_file] <NFA_input_file>\n"
+               "       %s -s <input_symbols_file|-> [-e] [-m nfa|lazy] [-M cache_megabytes] [-t ...] [-o trace_file] <NFA_input_file>\n"
+               "       %s -b <words_file> [-j threads] [-m nfa|lazy] [-M cache_megabytes] <NFA_input_file>\n"
+               "       %s -c <output_DFA_file> [-M cache_megabytes] <NFA_input_file>\n"
+               "       %s -r <compiled_DFA_file> <input_symbols_file|->\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if (runFileName != NULL) /// no NFA to parse, the compiled table is used as it is on disk
+        return runCompiledDFA(runFileName, argv[optind]);
 
-    // test printf("%s %s %d %d \n", nfa.acceptState, nfa.startState, nfa.numStates, nfa.numTransitions);
+    FILE* inputFile = fopen(argv[optind], "r");
 
+    if (inputFile == NULL) {
 
-    memcpy(nfa.transitions, transitions, sizeof(transitions));
+        perror("Error opening input file");
+        return 1;
+    }
 
-    // Check if the input word is accepted by the NFA
-    bool accepted = isAccepted(nfa, inputString, inputStringLength, states);
+    // Read the NFA and the input word, then build the transition tables
+    NFA nfa;
+    char** inputString;
+    long inputStringLength;
+    /// when streaming or in batch mode, the word in the NFA file is not needed
+    bool loaded = loadNFA(inputFile, &nfa, streamFileName || batchFileName ? NULL : &inputString, &inputStringLength);
+    fclose(inputFile);
+    if (!loaded) {
+        fprintf(stderr, "Error reading NFA input file: missing or malformed entries, or out of memory\n");
+        freeNFA(&nfa);
+        return 1;
+    }
+    if (!buildTransitionTable(&nfa)) {
+        fprintf(stderr, "Error building the transition tables: out of memory\n");
+        freeNFA(&nfa);
+        return 1;
+    }
 
-    if (accepted) {
-        printf("accept\n");
+    FILE* traceFile = NULL;
+    if (traceFileName != NULL && traceLevel != TRACE_OFF && (traceFile = fopen(traceFileName, "wb")) == NULL) {
+        perror("Error opening trace file");
+        freeNFA(&nfa);
+        return 1;
+    }
+    Trace trace;
+    initTrace(&trace, traceLevel, traceEvery, traceFile, &nfa);
+
+    int status = 0;
+    if (streamFileName != NULL) {
+        int fd = strcmp(streamFileName, "-") ? open(streamFileName, O_RDONLY) : STDIN_FILENO;
+        if (fd == -1) {
+            perror("Error opening input stream");
+            status = 1;
+        } else {
+            status = streamNFA(&nfa, fd, lazy, cacheBytes, reportMatches, &trace);
+            if (fd != STDIN_FILENO)
+                close(fd);
+        }
+    } else if (batchFileName != NULL) {
+        status = runBatch(&nfa, batchFileName, numThreads < 1 ? 1 : (int)numThreads, lazy, cacheBytes);
+    } else if (compileFileName != NULL) {
+        DFA dfa;
+        int numSubsetStates;
+        int compiled = compileDFA(&nfa, &dfa, cacheBytes, &numSubsetStates);
+        if (compiled == 0) {
+            fprintf(stderr, "The DFA needs more than %zu megabytes, raise the limit with -M\n", cacheBytes >> 20);
+            status = 1;
+        } else if (compiled < 0) {
+            fprintf(stderr, "Error compiling the DFA: out of memory\n");
+            status = 1;
+        } else {
+            bool written = writeDFAFile(compileFileName, &dfa, &nfa.symbolIds);
+            if (written)
+                printf("compiled %d DFA states (%d before minimization)\n", dfa.numStates, numSubsetStates);
+            else
+                perror("Error writing compiled DFA");
+            freeDFA(&dfa);
+            status = written ? 0 : 1;
+        }
+    } else if (parallel &&
+               (status = parallelVerdict(&nfa, inputString, inputStringLength, (int)numThreads, cacheBytes,
+                                         &trace)) != -1) {
+        printf(status ? "accept\n" : "reject\n");
+        status = 0;
     } else {
-        printf("reject\n");
+        status = 0; /// also when the parallel run gave up, the word is simply run sequentially
+        // Check if the input word is accepted by the NFA
+        int accepted = lazy ? isAcceptedLazy(&nfa, inputString, inputStringLength, cacheBytes, &trace)
+                            : isAccepted(&nfa, inputString, inputStringLength, &trace);
+
+        if (accepted < 0) {
+            fprintf(stderr, "Error allocating the lazy DFA cache: out of memory\n");
+            status = 1;
+        } else if (accepted) {
+            printf("accept\n");
+        } else {
+            printf("reject\n");
+        }
     }
 
-    return 0;
+    freeTrace(&trace);
+    if (traceFile != NULL && fclose(traceFile) != 0) {
+        perror("Error writing trace file");
+        status = 1;
+    }
+    freeNFA(&nfa);
+    return status;
 }
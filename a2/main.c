@@ -1,168 +1,2017 @@
+#define _GNU_SOURCE    // memmem
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
-int matchhere(char *regexp, char *text, int* matchlength);
-int matchstar(int c, char *regexp, char *text, int* matchlength);
-int matchplus(int c, char *regexp, char *text, int* matchlength);
-int matchquestion(int c, char *regexp, char *text, int* matchlength);
-int match(char *regexp, char *text, int* matchlength);
+/*
+ * Compiled form of a pattern: a Thompson NFA as an instruction array, run
+ * by the Pike VM below.  The pattern text is parsed once, by compile().
+ */
+enum { OP_CHAR, OP_ANY, OP_CLASS, OP_SPLIT, OP_JMP, OP_EOL, OP_MATCH };
 
+typedef struct {
+    int op;
+    int x;              // OP_CHAR: byte, OP_CLASS: class index, OP_SPLIT/OP_JMP: target
+    int y;              // OP_SPLIT: second, lower-priority target
+} Inst;
 
-void findAndPrintMatches(char *regexp, char *text, int matches[1000], int *noMatches) {
-    int startingPos = 0;
+/*
+ * a [...] bracket expression: bit c is set when byte c is in the set.
+ * nibbles holds the same set split for a pshufb lookup (see classspan):
+ * bit h & 7 of nibbles[h >> 3][c & 15] is set when byte c = h << 4 | l is.
+ */
+typedef struct {
+    unsigned char bits[32];
+    unsigned char nibbles[2][16];
+} CharClass;
 
-    while (text[startingPos] != '\0') {
-        int matchedLength = 0;
-        int matchFound = matchhere(regexp, text + startingPos, &matchedLength);
+typedef struct {
+    Inst *inst;
+    int len;
+    CharClass *classes;
+    int nclasses;
+    int anchored;       // pattern began with '^'
+    unsigned char *prefix;  // literal every match starts with
+    int prefixlen;
+    int rareoffset;     // least common byte of the prefix, searched for first
+    int required;       // some byte every match contains, or -1
+    CharClass first;    // bytes a match can begin with
+    int nullable;       // a match can begin without consuming a byte
+} Prog;
 
-        if (matchFound) {
-            matches[++*noMatches] = startingPos;
+typedef struct {
+    int pc;
+    long start;         // text offset the thread started matching at
+} Thread;
 
-            startingPos += matchedLength; // Move to the character after the matched substring
+typedef struct {
+    const Prog *prog;
+    Thread *clist, *nlist;
+    int nc, nn;
+    long *mark;         // mark[pc] == gen while pc is on the list being built
+    long gen;
+    int *stack;
+    long pos;           // next text offset pikestep will consume
+    long last;          // no match may start after this offset
+    int matched;        // a match is held in matchstart/matchend
+    long matchstart, matchend;
+} PikeVM;
+
+static inline int inclass(const CharClass *cls, int c)
+{
+    return cls->bits[c >> 3] & (1 << (c & 7));
+}
+
+/*
+ * parsecharset: fill cls from the [...] at set, expanding ranges and a
+ * leading ^; returns the first pattern character after the set
+ */
+const char *parsecharset(const char *set, CharClass *cls)
+{
+    int negate = 0, c, i;
+
+    memset(cls, 0, sizeof(*cls));
+    set++;
+    if (*set == '^') {
+        negate = 1;
+        set++;
+    }
+    while (*set != ']' && *set != '\0') {
+        if (set[1] == '-' && set[2] != '\0' && set[2] != ']') {
+            for (c = (unsigned char)set[0]; c <= (unsigned char)set[2]; c++)
+                cls->bits[c >> 3] |= 1 << (c & 7);
+            set += 3;
         } else {
-            startingPos += 1; // Move to the next character
+            c = (unsigned char)set[0];
+            cls->bits[c >> 3] |= 1 << (c & 7);
+            set++;
         }
     }
+    if (negate)
+        for (i = 0; i < 32; i++)
+            cls->bits[i] = ~cls->bits[i];
+    for (c = 0; c < 256; c++)
+        if (inclass(cls, c))
+            cls->nibbles[c >> 7][c & 15] |= 1 << ((c >> 4) & 7);
+    return *set == ']' ? set + 1 : set;
 }
 
+/*
+ * classspan: how many bytes of text[0..n) in a row are in cls.  With SSSE3
+ * or AVX2 a block of 16 or 32 bytes is classified at once: pshufb looks up
+ * each byte's low nibble in nibbles[] (bytes with the top bit set index the
+ * second table), another lookup turns the high nibble into its bit, and a
+ * byte is in the class when the two share a bit.
+ */
+long classspan(const CharClass *cls, const unsigned char *text, long n)
+{
+    long i = 0;
+
+#ifdef __AVX2__
+    {
+        const __m256i lo0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cls->nibbles[0]));
+        const __m256i lo1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cls->nibbles[1]));
+        const __m256i hi = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                            1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m256i low4 = _mm256_set1_epi8(0x0f), top = _mm256_set1_epi8(-128);
 
-int matchcharsets(char *regexp, char *text, int* matchlength)
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(text + i));
+            __m256i low = _mm256_or_si256(_mm256_shuffle_epi8(lo0, v),
+                                          _mm256_shuffle_epi8(lo1, _mm256_xor_si256(v, top)));
+            __m256i bit = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+            unsigned miss = _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_and_si256(low, bit), _mm256_setzero_si256()));
+
+            if (miss != 0)
+                return i + __builtin_ctz(miss);
+        }
+    }
+#endif
+#ifdef __SSSE3__
+    {
+        const __m128i lo0 = _mm_loadu_si128((const __m128i *)cls->nibbles[0]);
+        const __m128i lo1 = _mm_loadu_si128((const __m128i *)cls->nibbles[1]);
+        const __m128i hi = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m128i low4 = _mm_set1_epi8(0x0f), top = _mm_set1_epi8(-128);
+
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+            __m128i low = _mm_or_si128(_mm_shuffle_epi8(lo0, v),
+                                       _mm_shuffle_epi8(lo1, _mm_xor_si128(v, top)));
+            __m128i bit = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), low4));
+            unsigned miss = _mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_and_si128(low, bit), _mm_setzero_si128()));
+
+            if (miss != 0)
+                return i + __builtin_ctz(miss);
+        }
+    }
+#endif
+    while (i < n && inclass(cls, text[i]))
+        i++;
+    return i;
+}
+
+/*
+ * Bytes of typical text, most common first.  Anything not listed is taken
+ * to be rare, which makes it the better byte to hand to memchr.
+ */
+static const char commonbytes[] =
+    " etaoinsrhldcumfpgwybvkxjqzETAOINSRHLDCUMFPGWYBVKXJQZ0123456789";
+
+int byterank(int c)
 {
-    // Handle character sets within brackets
-    int negate = 0;
-    if (regexp[1] == '^') {
-        negate = 1;
-        regexp++;
+    const char *p = c != '\0' ? strchr(commonbytes, c) : NULL;
+
+    return p != NULL ? p - commonbytes : (int)sizeof(commonbytes);
+}
+
+/*
+ * analyze: find what a match must contain, for the prefilter in
+ * pikesearch: the run of plain characters the program starts with and,
+ * when there is none, the rarest byte that no quantifier can skip
+ */
+void analyze(Prog *prog)
+{
+    int pc, n = 0, top = 0, i;
+    int *stack = malloc((2 * prog->len + 1) * sizeof(int));
+    char *seen = calloc(prog->len, 1);
+
+    // bytes the first consuming instructions accept, for pikestep
+    memset(&prog->first, 0, sizeof(prog->first));
+    prog->nullable = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Inst *in = &prog->inst[pc = stack[--top]];
+
+        if (seen[pc])
+            continue;
+        seen[pc] = 1;
+        switch (in->op) {
+        case OP_SPLIT:
+            stack[top++] = in->y;
+            // fall through
+        case OP_JMP:
+            stack[top++] = in->x;
+            break;
+        case OP_CHAR:
+            prog->first.bits[in->x >> 3] |= 1 << (in->x & 7);
+            break;
+        case OP_ANY:
+            memset(&prog->first, 0xff, sizeof(prog->first));
+            break;
+        case OP_CLASS:
+            for (i = 0; i < 32; i++)
+                prog->first.bits[i] |= prog->classes[in->x].bits[i];
+            break;
+        default:
+            prog->nullable = 1;     // OP_EOL or OP_MATCH
+        }
     }
-    regexp++; // Move past '['
+    free(stack);
+    free(seen);
 
-    while (regexp[0] != ']' && regexp[0] != '\0') {
-        if (regexp[1] == '-' && regexp[2] != '\0') {
-            // Handle character range
-            if ((*text >= regexp[0] && *text <= regexp[2]) ||
-                (negate && (*text < regexp[0] || *text > regexp[2]))) {
-                (*matchlength)++;
-                return 1;  // Match found
-            }
-            regexp += 2;
+    prog->prefix = malloc(prog->len);
+    for (pc = 0; pc < prog->len && prog->inst[pc].op == OP_CHAR; pc++) {
+        prog->prefix[n++] = prog->inst[pc].x;
+        if (prog->inst[pc + 1].op == OP_SPLIT)
+            break;
+    }
+    prog->prefixlen = n;
+    prog->rareoffset = 0;
+    for (pc = 1; pc < n; pc++)
+        if (byterank(prog->prefix[pc]) > byterank(prog->prefix[prog->rareoffset]))
+            prog->rareoffset = pc;
+
+    prog->required = -1;
+    if (n > 0)
+        return;
+    for (pc = 0; pc < prog->len; pc++) {
+        const Inst *in = &prog->inst[pc];
+
+        if (in->op == OP_SPLIT && in->x < pc)
+            continue;   // the loop of a +, its atom was required once
+        if (in->op == OP_SPLIT)
+            pc = in->y > in->x ? in->y - 1 : in->x - 1;    // skip a * or ? body
+        else if (in->op == OP_CHAR &&
+                 (prog->required < 0 || byterank(in->x) > byterank(prog->required)))
+            prog->required = in->x;
+    }
+}
+
+/*
+ * compile: translate regexp into a Thompson NFA.  Each atom (c, ., \c or
+ * [...]) may carry one quantifier; * and + prefer the longer match and ?
+ * prefers skipping, the same order matchstar/matchplus/matchquestion tried.
+ */
+void compile(const char *regexp, Prog *prog)
+{
+    const char *re = regexp;
+    size_t n = strlen(regexp);
+
+    prog->inst = malloc((2 * n + 2) * sizeof(Inst));
+    prog->len = 0;
+    prog->classes = malloc((n / 2 + 1) * sizeof(CharClass));
+    prog->nclasses = 0;
+    prog->anchored = 0;
+    if (*re == '^') {
+        prog->anchored = 1;
+        re++;
+    }
+    while (*re != '\0') {
+        Inst atom = { OP_CHAR, 0, 0 };
+        int pc = prog->len;
+
+        if (re[0] == '$' && re[1] == '\0') {
+            prog->inst[prog->len++] = (Inst){ OP_EOL, 0, 0 };
+            break;
+        }
+        if (re[0] == '\\' && re[1] != '\0') {
+            atom.x = (unsigned char)re[1];
+            re += 2;
+        } else if (re[0] == '.') {
+            atom.op = OP_ANY;
+            re++;
+        } else if (re[0] == '[') {
+            atom.op = OP_CLASS;
+            atom.x = prog->nclasses;
+            re = parsecharset(re, &prog->classes[prog->nclasses++]);
         } else {
-            // Match individual characters
-            if ((*text == regexp[0]) ||
-                (negate && (*text != regexp[0]))) {
-                (*matchlength)++;
-                return 1;  // Match found
-            }
+            atom.x = (unsigned char)re[0];
+            re++;
+        }
+
+        if (*re == '*') {
+            prog->inst[pc] = (Inst){ OP_SPLIT, pc + 1, pc + 3 };
+            prog->inst[pc + 1] = atom;
+            prog->inst[pc + 2] = (Inst){ OP_JMP, pc, 0 };
+            prog->len += 3;
+            re++;
+        } else if (*re == '+') {
+            prog->inst[pc] = atom;
+            prog->inst[pc + 1] = (Inst){ OP_SPLIT, pc, pc + 2 };
+            prog->len += 2;
+            re++;
+        } else if (*re == '?') {
+            prog->inst[pc] = (Inst){ OP_SPLIT, pc + 2, pc + 1 };
+            prog->inst[pc + 1] = atom;
+            prog->len += 2;
+            re++;
+        } else {
+            prog->inst[prog->len++] = atom;
         }
-        regexp++;
     }
+    prog->inst[prog->len++] = (Inst){ OP_MATCH, 0, 0 };
+    analyze(prog);
+}
 
-    return 0;
+void freeprog(Prog *prog)
+{
+    free(prog->inst);
+    free(prog->classes);
+    free(prog->prefix);
 }
 
-/* match: search for regexp anywhere in text */
-int match(char *regexp, char *text, int* matchlength)
+/*
+ * nextcandidate: first offset >= pos where the literal prefix occurs, or
+ * -1.  The rarest prefix byte is found with memchr, which glibc vectorizes,
+ * and the rest of the prefix is then compared in place.
+ */
+long nextcandidate(const Prog *prog, const char *text, long length, long pos)
 {
-    if (regexp[0] == '^')
-        return matchhere(regexp+1, text, matchlength);
-    do {    /* must look even if string is empty */
-        if (matchhere(regexp, text, matchlength))
-            return 1;
-    } while (*text++ != '\0');
+    const unsigned char *prefix = prog->prefix;
+    int n = prog->prefixlen, k = prog->rareoffset;
+
+    if (n >= 8) {
+        const char *hit = memmem(text + pos, length - pos, prefix, n);
+        return hit != NULL ? hit - text : -1;
+    }
+    while (pos + n <= length) {
+        const char *hit = memchr(text + pos + k, prefix[k], length - n - pos + 1);
+
+        if (hit == NULL)
+            return -1;
+        pos = hit - text - k;
+        if (memcmp(text + pos, prefix, n) == 0)
+            return pos;
+        pos++;
+    }
+    return -1;
+}
+
+/* instmatches: does the consuming instruction in accept byte c */
+static inline int instmatches(const Prog *prog, const Inst *in, int c)
+{
+    switch (in->op) {
+    case OP_CHAR:
+        return in->x == c;
+    case OP_ANY:
+        return 1;
+    case OP_CLASS:
+        return inclass(&prog->classes[in->x], c);
+    }
     return 0;
 }
 
+/*
+ * addthread: put pc on the list, following jumps and splits in priority
+ * order.  A pc already on the list is skipped; the thread that got there
+ * first has higher priority, so the later one can never win.
+ */
+void addthread(PikeVM *vm, Thread *list, int *n, int pc, long start, long pos, long length)
+{
+    int top = 0;
+
+    vm->stack[top++] = pc;
+    while (top > 0) {
+        const Inst *in;
+
+        pc = vm->stack[--top];
+        if (vm->mark[pc] == vm->gen)
+            continue;
+        vm->mark[pc] = vm->gen;
+        in = &vm->prog->inst[pc];
+        switch (in->op) {
+        case OP_JMP:
+            vm->stack[top++] = in->x;
+            break;
+        case OP_SPLIT:
+            vm->stack[top++] = in->y;
+            vm->stack[top++] = in->x;
+            break;
+        case OP_EOL:
+            if (pos == length)
+                vm->stack[top++] = pc + 1;
+            break;
+        default:
+            list[*n].pc = pc;
+            list[(*n)++].start = start;
+        }
+    }
+}
 
-/* matchhere: search for regexp at beginning of text */
-int matchhere(char *regexp, char *text, int* matchlength)
+void initvm(PikeVM *vm, const Prog *prog)
 {
-    int temp = *matchlength;
-    if (regexp[0] == '\0')
+    vm->prog = prog;
+    vm->clist = malloc(prog->len * sizeof(Thread));
+    vm->nlist = malloc(prog->len * sizeof(Thread));
+    vm->mark = calloc(prog->len, sizeof(long));
+    vm->gen = 0;
+    vm->stack = malloc((2 * prog->len + 1) * sizeof(int));
+}
+
+void freevm(PikeVM *vm)
+{
+    free(vm->clist);
+    free(vm->nlist);
+    free(vm->mark);
+    free(vm->stack);
+}
+
+/* pikestart: set the VM up to look for a match starting in [from, last] */
+void pikestart(PikeVM *vm, long from, long last)
+{
+    vm->nc = 0;
+    vm->gen++;
+    vm->pos = from;
+    vm->last = last;
+    vm->matched = 0;
+}
+
+/*
+ * pikestep: consume text[vm->pos].  Until a match is found a new thread
+ * is started there first, if the byte can begin one; it has lower
+ * priority than every thread already running.  A thread reaching
+ * OP_MATCH records its match and cuts off the lower-priority threads.
+ */
+void pikestep(PikeVM *vm, const char *text, long length)
+{
+    const Prog *prog = vm->prog;
+    long pos = vm->pos;
+    Thread *swap;
+    int i;
+
+    if (!vm->matched && pos <= vm->last && (!prog->anchored || pos == 0) &&
+        (prog->nullable || (pos < length && inclass(&prog->first, (unsigned char)text[pos]))))
+        addthread(vm, vm->clist, &vm->nc, 0, pos, pos, length);
+
+    vm->nn = 0;
+    vm->gen++;
+    for (i = 0; i < vm->nc; i++) {
+        const Thread *t = &vm->clist[i];
+        const Inst *in = &prog->inst[t->pc];
+
+        if (in->op == OP_MATCH) {
+            vm->matched = 1;
+            vm->matchstart = t->start;
+            vm->matchend = pos;
+            break;
+        }
+        if (pos < length && instmatches(prog, in, (unsigned char)text[pos]))
+            addthread(vm, vm->nlist, &vm->nn, t->pc + 1, t->start, pos + 1, length);
+    }
+    swap = vm->clist;
+    vm->clist = vm->nlist;
+    vm->nlist = swap;
+    vm->nc = vm->nn;
+    vm->pos++;
+}
+
+/*
+ * pikesearch: find the leftmost match starting in [from, last], and of
+ * the matches starting there the one the backtracker would find first.
+ * Threads are kept in priority order, one per pc, so the scan is O(n*m)
+ * whatever the pattern.
+ */
+int pikesearch(PikeVM *vm, const char *text, long length, long from, long last,
+               long *matchstart, long *matchend)
+{
+    const Prog *prog = vm->prog;
+
+    if (prog->required >= 0 && memchr(text + from, prog->required, length - from) == NULL)
+        return 0;
+
+    pikestart(vm, from, last);
+    while (vm->pos <= length) {
+        // with no thread alive, skip straight to where the prefix occurs
+        if (vm->nc == 0 && prog->prefixlen > 0 && !prog->anchored) {
+            vm->pos = nextcandidate(prog, text, length, vm->pos);
+            if (vm->pos < 0 || vm->pos > last)
+                break;
+        }
+        pikestep(vm, text, length);
+        if (vm->nc == 0 && (vm->matched || prog->anchored || vm->pos > last))
+            break;
+    }
+    *matchstart = vm->matchstart;
+    *matchend = vm->matchend;
+    return vm->matched;
+}
+
+/*
+ * Bounded backtracking, as in RE2's BitState: the backtracker tries
+ * alternatives in the same priority order as the Pike VM, but records each
+ * (pc, text offset) it has visited in a bitmap and never explores one
+ * twice.  A visited pair either failed already or led to the match that
+ * ended the search, so the search stays O(n*m) with far less bookkeeping
+ * per step than the VM.  The bitmap costs m bits per text byte, so it is
+ * only picked when that fits in cache; -e backtrack grows it to whatever
+ * the text needs.
+ */
+#ifndef BITSTATE_MAX_BITS
+#define BITSTATE_MAX_BITS (256 * 1024)
+#endif
+
+enum { ENGINE_AUTO, ENGINE_PIKE, ENGINE_BACKTRACK };
+
+int engine = ENGINE_AUTO;   // set with -e
+
+typedef struct {
+    int pc;
+    long pos;
+} Job;
+
+typedef struct {
+    const Prog *prog;
+    unsigned long *visited;     // bit (pos - from) * len + pc
+    size_t nwords;              // words allocated for visited
+    size_t dirty;               // words of visited the last search may have set
+    Job *jobs;
+    size_t njobs, jobcap;
+} BitState;
+
+typedef struct {
+    const Prog *prog;
+    PikeVM vm;
+    BitState bs;
+} Matcher;
+
+#define WORDBITS (8 * sizeof(unsigned long))
+
+void initbitstate(BitState *bs, const Prog *prog)
+{
+    bs->prog = prog;
+    bs->nwords = BITSTATE_MAX_BITS / WORDBITS + 1;
+    bs->visited = calloc(bs->nwords, sizeof(unsigned long));
+    bs->dirty = 0;
+    bs->jobcap = 64;
+    bs->jobs = malloc(bs->jobcap * sizeof(Job));
+    bs->njobs = 0;
+}
+
+/* growbitstate: make visited at least nwords words long; 0 if out of memory */
+int growbitstate(BitState *bs, size_t nwords)
+{
+    unsigned long *visited;
+
+    if (nwords <= bs->nwords)
         return 1;
-    if (regexp[0] == '\\') {
-        // Handle the escape character
-        if (regexp[1] == *text) {
-            (*matchlength)++;
-            return matchhere(regexp + 2, text + 1, matchlength);
+    // a fresh zeroed bitmap, so nothing is dirty any more
+    visited = calloc(nwords, sizeof(unsigned long));
+    if (visited == NULL)
+        return 0;
+    free(bs->visited);
+    bs->visited = visited;
+    bs->nwords = nwords;
+    bs->dirty = 0;
+    return 1;
+}
+
+void freebitstate(BitState *bs)
+{
+    free(bs->visited);
+    free(bs->jobs);
+}
+
+static inline void pushjob(BitState *bs, int pc, long pos)
+{
+    if (bs->njobs == bs->jobcap) {
+        bs->jobcap *= 2;
+        bs->jobs = realloc(bs->jobs, bs->jobcap * sizeof(Job));
+    }
+    bs->jobs[bs->njobs].pc = pc;
+    bs->jobs[bs->njobs++].pos = pos;
+}
+
+/* visit: mark (pc, pos) visited; 0 if it already was */
+static inline int visit(BitState *bs, long from, int pc, long pos)
+{
+    size_t bit = (size_t)(pos - from) * bs->prog->len + pc;
+
+    if (bs->visited[bit / WORDBITS] & (1UL << (bit % WORDBITS)))
+        return 0;
+    bs->visited[bit / WORDBITS] |= 1UL << (bit % WORDBITS);
+    if (bit / WORDBITS >= bs->dirty)
+        bs->dirty = bit / WORDBITS + 1;
+    return 1;
+}
+
+/* runspan: how many bytes from text[pos] on the consuming instruction in accepts in a row */
+static long runspan(const Prog *prog, const Inst *in, const char *text, long pos, long length)
+{
+    const unsigned char *p = (const unsigned char *)text + pos;
+    long n = length - pos, i = 0;
+
+    switch (in->op) {
+    case OP_ANY:
+        return n;
+    case OP_CLASS:
+        return classspan(&prog->classes[in->x], p, n);
+    }
+    while (i < n && p[i] == in->x)
+        i++;
+    return i;
+}
+
+/*
+ * trystart: backtrack from start, returning the end of the first match
+ * found or -1.  The loops of x* and x+ are not stepped a byte at a time:
+ * the whole run of x is measured with runspan, and the jobs the loop would
+ * have left behind, continuing after each shorter run, are pushed at once.
+ */
+long trystart(BitState *bs, const char *text, long length, long from, long start)
+{
+    const Prog *prog = bs->prog;
+
+    bs->njobs = 0;
+    pushjob(bs, 0, start);
+    while (bs->njobs > 0) {
+        Job job = bs->jobs[--bs->njobs];
+        int pc = job.pc;
+        long pos = job.pos;
+
+        for (;;) {
+            const Inst *in = &prog->inst[pc];
+            long run, i;
+
+            if (!visit(bs, from, pc, pos))
+                break;
+
+            if (in->op == OP_SPLIT && in->x == pc + 1 && in->y == pc + 3 &&
+                prog->inst[pc + 2].op == OP_JMP) {
+                // x*: pc + 1 and pc + 2 are only reached through pc
+                run = runspan(prog, &prog->inst[pc + 1], text, pos, length);
+                pushjob(bs, in->y, pos);
+                for (i = 1; i <= run && visit(bs, from, pc, pos + i); i++)
+                    pushjob(bs, in->y, pos + i);
+                break;
+            } else if (in->op == OP_SPLIT) {
+                pushjob(bs, in->y, pos);
+                pc = in->x;
+            } else if (in->op == OP_JMP) {
+                pc = in->x;
+            } else if (in->op == OP_EOL) {
+                if (pos != length)
+                    break;
+                pc++;
+            } else if (in->op == OP_MATCH) {
+                return pos;
+            } else if (prog->inst[pc + 1].op == OP_SPLIT && prog->inst[pc + 1].x == pc) {
+                // x+: the same, once the first x has matched
+                run = runspan(prog, in, text, pos, length);
+                for (i = 1; i <= run; i++) {
+                    if (!visit(bs, from, pc + 1, pos + i))
+                        break;
+                    pushjob(bs, pc + 2, pos + i);
+                    if (!visit(bs, from, pc, pos + i))
+                        break;
+                }
+                break;
+            } else {
+                if (pos >= length || !instmatches(prog, in, (unsigned char)text[pos]))
+                    break;
+                pc++;
+                pos++;
+            }
         }
+    }
+    return -1;
+}
+
+/* bitstatesearch: pikesearch's contract, by bounded backtracking from each start */
+int bitstatesearch(BitState *bs, const char *text, long length, long from, long last,
+                   long *matchstart, long *matchend)
+{
+    const Prog *prog = bs->prog;
+    long start, end;
+
+    if (prog->required >= 0 && memchr(text + from, prog->required, length - from) == NULL)
         return 0;
+
+    memset(bs->visited, 0, bs->dirty * sizeof(unsigned long));
+    bs->dirty = 0;
+    for (start = from; start <= length && start <= last; start++) {
+        if (prog->anchored && start > 0)
+            break;
+        if (prog->prefixlen > 0 && !prog->anchored) {
+            start = nextcandidate(prog, text, length, start);
+            if (start < 0 || start > last)
+                break;
+        }
+        if (!prog->nullable && (start == length ||
+                                !inclass(&prog->first, (unsigned char)text[start])))
+            continue;
+        end = trystart(bs, text, length, from, start);
+        if (end >= 0) {
+            *matchstart = start;
+            *matchend = end;
+            return 1;
+        }
     }
-    if (regexp[1] == '*')
-        return matchstar(regexp[0], regexp+2, text, matchlength);
-    if (regexp[1] == '+')
-        return matchplus(regexp[0], regexp+2, text, matchlength);
-    if (regexp[1] == '?')
-        return matchquestion(regexp[0], regexp + 2, text, matchlength);
-
-    if (regexp[0] == '$' && regexp[1] == '\0')
-        return *text == '\0';
-    if (regexp[0] == '[')
-        return matchcharsets(regexp, text, matchlength);
-    if (*text!='\0' && (regexp[0]=='.' || regexp[0]==*text)) {
-        (*matchlength)++;
-        return matchhere(regexp + 1, text + 1, matchlength);
-    }
-    *matchlength = temp;
     return 0;
 }
 
-int matchplus(int c, char *regexp, char *text, int* matchlength)
+void initmatcher(Matcher *m, const Prog *prog)
+{
+    m->prog = prog;
+    initvm(&m->vm, prog);
+    initbitstate(&m->bs, prog);
+}
+
+void freematcher(Matcher *m)
+{
+    freevm(&m->vm);
+    freebitstate(&m->bs);
+}
+
+/*
+ * search: find the leftmost match starting in [from, last], with the
+ * backtracker when its bitmap for the rest of the text fits in
+ * BITSTATE_MAX_BITS and the Pike VM otherwise.  -e pike always takes the
+ * VM; -e backtrack always takes the backtracker, growing the bitmap to
+ * m bits per byte of the rest of the text, and gives up with an error if
+ * that much memory is not there.
+ */
+int search(Matcher *m, const char *text, long length, long from, long last,
+           long *matchstart, long *matchend)
+{
+    size_t bits = (size_t)m->prog->len * (length - from + 1);
+
+    if (engine == ENGINE_PIKE || (engine == ENGINE_AUTO && bits > BITSTATE_MAX_BITS))
+        return pikesearch(&m->vm, text, length, from, last, matchstart, matchend);
+    if (!growbitstate(&m->bs, bits / WORDBITS + 1)) {
+        fprintf(stderr, "-e backtrack: no memory for a %zu-byte bitmap\n", bits / 8);
+        exit(2);
+    }
+    return bitstatesearch(&m->bs, text, length, from, last, matchstart, matchend);
+}
+
+/* match: search for the compiled pattern anywhere in text */
+int match(const Prog *prog, const char *text, int *matchlength)
+{
+    long matchStart, matchEnd;
+    Matcher m;
+    int found;
+
+    initmatcher(&m, prog);
+    found = search(&m, text, strlen(text), 0, strlen(text), &matchStart, &matchEnd);
+    if (found)
+        *matchlength = matchEnd - matchStart;
+    freematcher(&m);
+    return found;
+}
+
+/*
+ * nextmatch: find the next non-overlapping match at or after *from and
+ * move *from past it; after an empty match it moves on by one character
+ */
+int nextmatch(Matcher *m, const char *text, long length, long *from,
+              long *matchStart, long *matchEnd)
+{
+    if (*from >= length ||
+        !search(m, text, length, *from, length, matchStart, matchEnd) ||
+        *matchStart >= length)
+        return 0;
+
+    if (*matchEnd > *matchStart)
+        *from = *matchEnd; // Move to the character after the matched substring
+    else
+        *from = *matchStart + 1; // Empty match, move to the next character
+    return 1;
+}
+
+/* matchiter: the non-overlapping matches of one text, one at a time */
+typedef struct {
+    Matcher *m;
+    const char *text;
+    int64_t length;
+    int64_t from;       // where the next search starts
+} MatchIter;
+
+void initmatchiter(MatchIter *it, Matcher *m, const char *text, int64_t length)
+{
+    it->m = m;
+    it->text = text;
+    it->length = length;
+    it->from = 0;
+}
+
+/* nextmatchiter: yield the next match as (start, length); 0 when there are no more */
+int nextmatchiter(MatchIter *it, int64_t *start, int64_t *length)
+{
+    long from = it->from, matchStart, matchEnd;
+
+    if (!nextmatch(it->m, it->text, it->length, &from, &matchStart, &matchEnd))
+        return 0;
+    it->from = from;
+    *start = matchStart;
+    *length = matchEnd - matchStart;
+    return 1;
+}
+
+/* called with each match in text order; a nonzero return stops the scan */
+typedef int (*MatchFn)(void *arg, int64_t start, int64_t length);
+
+/* findmatches: hand every match in text to fn as it is found; returns how many */
+int64_t findmatches(Matcher *m, const char *text, int64_t length, MatchFn fn, void *arg)
+{
+    MatchIter it;
+    int64_t start, len, count = 0;
+
+    initmatchiter(&it, m, text, length);
+    while (nextmatchiter(&it, &start, &len)) {
+        count++;
+        if (fn(arg, start, len))
+            break;
+    }
+    return count;
+}
+
+/*
+ * Writer: buffered output for match listings, so printing costs neither
+ * a stdio call per number nor memory that grows with the match count
+ */
+#ifndef OUTPUT_BUFFER_BYTES
+#define OUTPUT_BUFFER_BYTES (1 << 16)
+#endif
+
+typedef struct {
+    FILE *file;
+    char *buf;
+    size_t len;
+} Writer;
+
+void initwriter(Writer *w, FILE *file)
+{
+    w->file = file;
+    w->buf = malloc(OUTPUT_BUFFER_BYTES);
+    w->len = 0;
+}
+
+void flushwriter(Writer *w)
+{
+    fwrite(w->buf, 1, w->len, w->file);
+    w->len = 0;
+}
+
+void freewriter(Writer *w)
+{
+    flushwriter(w);
+    fflush(w->file);
+    free(w->buf);
+}
+
+static inline void writestr(Writer *w, const char *str, size_t n)
+{
+    if (w->len + n > OUTPUT_BUFFER_BYTES)
+        flushwriter(w);
+    memcpy(w->buf + w->len, str, n);
+    w->len += n;
+}
+
+/* writeint: v in decimal, followed by the character end unless it is 0 */
+static inline void writeint(Writer *w, int64_t v, char end)
+{
+    char digits[24];
+    int n = sizeof(digits);
+
+    if (end != '\0')
+        digits[--n] = end;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    writestr(w, digits + n, sizeof(digits) - n);
+}
+
+/* printposition: findAndPrintMatches' format, "match p1 p2 ..." */
+int printposition(void *arg, int64_t start, int64_t length)
+{
+    Writer *out = arg;
+
+    (void)length;
+    writestr(out, " ", 1);
+    writeint(out, start, '\0');
+    return 0;
+}
+
+int64_t findAndPrintMatches(const Prog *prog, const char *text, int64_t length, Writer *out) {
+    MatchIter it;
+    Matcher m;
+    int64_t start, len, count;
+
+    initmatcher(&m, prog);
+    initmatchiter(&it, &m, text, length);
+    if (nextmatchiter(&it, &start, &len)) {
+        // the first match decides the header, the rest stream out as they are found
+        writestr(out, "match", 5);
+        printposition(out, start, len);
+        count = 1;
+        while (nextmatchiter(&it, &start, &len)) {
+            printposition(out, start, len);
+            count++;
+        }
+    } else {
+        writestr(out, "no match", 8);
+        count = 0;
+    }
+    freematcher(&m);
+    return count;
+}
+
+/* scans one text: the whole file, or line lineno of it when lineno > 0 */
+typedef long (*ScanFn)(void *arg, const char *text, long length, long lineno);
+
+/*
+ * scanfile: map path into memory and hand it to scan, in one piece or,
+ * with bylines set, a line at a time.  Returns the number of matches, or
+ * -1 if the file cannot be mapped.
+ */
+long scanfile(const char *path, int bylines, ScanFn scan, void *arg)
 {
-    int foundA = 0;
+    struct stat st;
+    const char *data = NULL;
+    long size, count = 0;
+    int fd;
 
-    while (*text != '\0' && (*text == c || c == '.')) {
-        if (*text == c) {
-            foundA = 1; // Set the flag when 'c' is found
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
         }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (bylines) {
+        const char *line = data, *end = data + size;
+        long lineno = 1;
+
+        while (line < end) {
+            const char *nl = memchr(line, '\n', end - line);
+            long length = (nl != NULL ? nl : end) - line;
 
-        text++;
-        (*matchlength)++;
+            count += scan(arg, line, length, lineno);
+            line += length + 1;
+            lineno++;
+        }
+    } else {
+        count = scan(arg, data, size, 0);
     }
+    if (size > 0)
+        munmap((void *)data, size);
+    return count;
+}
+
+/* what scantext needs: one pattern's matcher and where its output goes */
+typedef struct {
+    Matcher m;
+    Writer *out;
+    long lineno;        // line being scanned, 0 for the whole file
+} TextScan;
 
-    return foundA ? matchhere(regexp, text, matchlength) : 0; // Require at least one 'c' before continuing
+/* printoffset: one match per output line, as offset or line:column */
+int printoffset(void *arg, int64_t start, int64_t length)
+{
+    TextScan *ts = arg;
+
+    (void)length;
+    if (ts->lineno > 0)
+        writeint(ts->out, ts->lineno, ':');
+    writeint(ts->out, start, '\n');
+    return 0;
 }
 
+/* scantext: print every match of one pattern in text */
+long scantext(void *arg, const char *text, long length, long lineno)
+{
+    TextScan *ts = arg;
+
+    ts->lineno = lineno;
+    return findmatches(&ts->m, text, length, printoffset, ts);
+}
 
-int matchquestion(int c, char *regexp, char *text, int* matchlength)
+/*
+ * Parallel scan: the text is cut into chunks that worker threads take in
+ * turn, each searching its chunk as if the scan had restarted at the
+ * chunk's first byte.  Matches may run past the end of a chunk, since the
+ * whole text is mapped.  The only thing a chunk cannot know is where the
+ * previous chunk's last match ended, so the lists are stitched together
+ * afterwards in order (see mergechunk).  In per-line mode chunks end at
+ * line breaks and nothing needs stitching.
+ */
+#ifndef SCAN_CHUNK_BYTES
+#define SCAN_CHUNK_BYTES (1L << 20)
+#endif
+
+typedef struct {
+    long start, end;    // a match, or in per-line mode the line within the chunk and column
+} Span;
+
+typedef struct {
+    long begin, end;    // the chunk of the text
+    Span *spans;
+    size_t n, cap;
+    long lines;         // per-line mode: lines the chunk holds
+} Chunk;
+
+typedef struct {
+    const Prog *prog;
+    int threads;
+    int bylines;
+    const char *text;
+    long length;
+    Chunk *chunks;
+    long nchunks;
+    atomic_long next;   // first chunk no worker has taken yet
+    Writer *out;
+} ParallelScan;
+
+static void addspan(Chunk *c, long start, long end)
 {
-    if (matchhere(regexp, text, matchlength)) {
-        if(regexp[0] == '\0')
-            (*matchlength)++;
-        return 1;
+    if (c->n == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 64;
+        c->spans = realloc(c->spans, c->cap * sizeof(Span));
     }
+    c->spans[c->n].start = start;
+    c->spans[c->n++].end = end;
+}
 
-    if (*text != '\0' && (c == '.' || c == *(text))) {
-        if (matchhere(regexp, text + 1, matchlength)) {
-            (*matchlength)++;
-            return 1;
+/* restart: where the scan goes on after the match sp */
+static inline long restart(const Span *sp)
+{
+    return sp->end > sp->start ? sp->end : sp->start + 1;
+}
+
+void *scanworker(void *arg)
+{
+    ParallelScan *job = arg;
+    const char *text = job->text;
+    long length = job->length, k, from, matchStart, matchEnd;
+    Matcher m;
+
+    initmatcher(&m, job->prog);
+    while ((k = atomic_fetch_add(&job->next, 1)) < job->nchunks) {
+        Chunk *c = &job->chunks[k];
+
+        if (job->bylines) {
+            const char *line = text + c->begin, *end = text + c->end;
+
+            for (; line < end; c->lines++) {
+                const char *nl = memchr(line, '\n', end - line);
+                long len = (nl != NULL ? nl : end) - line;
+
+                from = 0;
+                while (nextmatch(&m, line, len, &from, &matchStart, &matchEnd))
+                    addspan(c, c->lines, matchStart);
+                line += len + 1;
+            }
+            continue;
+        }
+        from = c->begin;
+        while (from < c->end &&
+               search(&m, text, length, from, c->end - 1, &matchStart, &matchEnd) &&
+               matchStart < length) {
+            addspan(c, matchStart, matchEnd);
+            from = restart(&c->spans[c->n - 1]);
         }
     }
+    freematcher(&m);
+    return NULL;
+}
+
+/*
+ * mergechunk: print the matches of chunk c given that the sequential scan
+ * resumes at *from, and advance *from.  The chunk's list is right from
+ * its first match at or after *from, as long as the list's own scan
+ * reached that match from an offset no later than *from: no match starts
+ * in between, so both scans find the same one.  Only when *from falls
+ * inside one of the list's matches (a match of the previous chunk
+ * reached into this one) is the scan redone until the two meet again.
+ */
+long mergechunk(Matcher *m, const ParallelScan *job, const Chunk *c, long *from)
+{
+    long count = 0, matchStart, matchEnd;
+    size_t j = 0;
+
+    for (;;) {
+        Span sp;
+
+        while (j < c->n && c->spans[j].start < *from)
+            j++;
+        if (j == 0 || restart(&c->spans[j - 1]) <= *from)
+            break;
+        if (!search(m, job->text, job->length, *from, c->end - 1, &matchStart, &matchEnd) ||
+            matchStart >= job->length)
+            return count;
+        sp.start = matchStart;
+        sp.end = matchEnd;
+        writeint(job->out, sp.start, '\n');
+        count++;
+        *from = restart(&sp);
+    }
+    for (; j < c->n; j++) {
+        writeint(job->out, c->spans[j].start, '\n');
+        count++;
+        *from = restart(&c->spans[j]);
+    }
+    return count;
+}
 
+/* scanparallel: scantext over the whole mapped file, on job->threads threads */
+long scanparallel(void *arg, const char *text, long length, long lineno)
+{
+    ParallelScan *job = arg;
+    long chunkbytes = length / (4L * job->threads) + 1, pos, k, count = 0, from = 0;
+    pthread_t *threads = malloc(job->threads * sizeof(pthread_t));
+    int t, started = 0;
+    Matcher m;
+
+    (void)lineno;
+    if (chunkbytes < SCAN_CHUNK_BYTES)
+        chunkbytes = SCAN_CHUNK_BYTES;
+    job->text = text;
+    job->length = length;
+    job->chunks = malloc((length / chunkbytes + 2) * sizeof(Chunk));
+    job->nchunks = 0;
+    for (pos = 0; pos < length; pos = job->chunks[job->nchunks++].end) {
+        Chunk *c = &job->chunks[job->nchunks];
+        long end = pos + chunkbytes < length ? pos + chunkbytes : length;
+
+        if (job->bylines && end < length) {
+            const char *nl = memchr(text + end, '\n', length - end);
+
+            end = nl != NULL ? nl - text + 1 : length;
+        }
+        memset(c, 0, sizeof(*c));
+        c->begin = pos;
+        c->end = end;
+    }
+    atomic_init(&job->next, 0);
+
+    // chunks are handed out through job->next, so any that a thread which
+    // failed to start would have taken are scanned here or by the others
+    for (t = 1; t < job->threads; t++)
+        if (pthread_create(&threads[started], NULL, scanworker, job) == 0)
+            started++;
+    scanworker(job);
+    for (t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    initmatcher(&m, job->prog);
+    for (k = 0; k < job->nchunks; k++) {
+        Chunk *c = &job->chunks[k];
+        size_t j;
+
+        if (job->bylines) {
+            for (j = 0; j < c->n; j++) {
+                writeint(job->out, from + c->spans[j].start + 1, ':');
+                writeint(job->out, c->spans[j].end, '\n');
+            }
+            count += c->n;
+            from += c->lines;
+        } else {
+            count += mergechunk(&m, job, c, &from);
+        }
+        free(c->spans);
+    }
+    freematcher(&m);
+    free(job->chunks);
+    free(threads);
+    return count;
+}
+
+/*
+ * A set of patterns searched for in a single pass over the text.  Each
+ * pattern keeps its own VM, but one that has no thread alive costs
+ * nothing: at each offset only the patterns whose first byte fits are
+ * started, found through a table indexed by that byte.  The VMs settle
+ * their matches at different times, so matches are held back until no
+ * pattern can still find one that starts earlier, and are printed in
+ * (offset, id) order.
+ */
+enum { SET_IDLE, SET_ACTIVE, SET_DONE };
+
+typedef struct {
+    long start;
+    int id;
+} SetMatch;
+
+typedef struct {
+    int n;
+    Prog *progs;
+    int *ids;           // line of the patterns file each one came from
+    PikeVM *vms;
+    char *state;
+    int *active;        // the SET_ACTIVE patterns
+    int nactive;
+    int *bybyte[256];   // patterns a match of which can begin with the byte
+    int nbybyte[256];
+    int *nullable;      // patterns that can match without consuming a byte
+    int nnullable;
+    SetMatch *held;     // settled matches not printed yet, in (start, id) order
+    size_t nheld, capheld;
+    Writer *out;
+} PatternSet;
+
+/* loadpatternset: compile one pattern per line of path, skipping blank lines */
+int loadpatternset(const char *path, PatternSet *set)
+{
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0, size = 16;
+    ssize_t len;
+    int lineno = 0, i, c;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    memset(set, 0, sizeof(*set));
+    set->progs = malloc(size * sizeof(Prog));
+    set->ids = malloc(size * sizeof(int));
+    while ((len = getline(&line, &cap, file)) >= 0) {
+        lineno++;
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if ((size_t)set->n == size) {
+            size *= 2;
+            set->progs = realloc(set->progs, size * sizeof(Prog));
+            set->ids = realloc(set->ids, size * sizeof(int));
+        }
+        compile(line, &set->progs[set->n]);
+        set->ids[set->n++] = lineno;
+    }
+    free(line);
+    fclose(file);
+
+    set->vms = malloc(set->n * sizeof(PikeVM));
+    set->state = malloc(set->n);
+    set->active = malloc(set->n * sizeof(int));
+    set->nullable = malloc(set->n * sizeof(int));
+    for (i = 0; i < set->n; i++) {
+        initvm(&set->vms[i], &set->progs[i]);
+        if (set->progs[i].nullable)
+            set->nullable[set->nnullable++] = i;
+    }
+    for (c = 0; c < 256; c++) {
+        set->bybyte[c] = malloc(set->n * sizeof(int));
+        for (i = 0; i < set->n; i++)
+            if (!set->progs[i].nullable && inclass(&set->progs[i].first, c))
+                set->bybyte[c][set->nbybyte[c]++] = i;
+    }
     return 0;
 }
 
-/* matchstar: search for c*regexp at beginning of text */
-int matchstar(int c, char *regexp, char *text, int* matchlength)
+void freepatternset(PatternSet *set)
 {
-    char *t;
+    int i;
 
-    for (t = text; *t != '\0' && (*t == c || c == '.'); t++, (*matchlength)++)
-        ;
-    do {	/* * matches zero or more */
-        if (matchhere(regexp, t, matchlength)) {
-            (*matchlength)++;
-            return 1;
+    for (i = 0; i < set->n; i++) {
+        freevm(&set->vms[i]);
+        freeprog(&set->progs[i]);
+    }
+    for (i = 0; i < 256; i++)
+        free(set->bybyte[i]);
+    free(set->progs);
+    free(set->ids);
+    free(set->vms);
+    free(set->state);
+    free(set->active);
+    free(set->nullable);
+    free(set->held);
+}
+
+/* holdmatch: keep a settled match until everything before it is known */
+static void holdmatch(PatternSet *set, long start, int id)
+{
+    size_t k;
+
+    if (set->nheld == set->capheld) {
+        set->capheld = set->capheld ? 2 * set->capheld : 64;
+        set->held = realloc(set->held, set->capheld * sizeof(SetMatch));
+    }
+    // matches mostly settle in order, so the insertion is short
+    for (k = set->nheld++; k > 0 && (set->held[k - 1].start > start ||
+         (set->held[k - 1].start == start && set->held[k - 1].id > id)); k--)
+        set->held[k] = set->held[k - 1];
+    set->held[k].start = start;
+    set->held[k].id = id;
+}
+
+/* printheld: print the held matches that start before bound */
+static void printheld(PatternSet *set, long bound, long lineno)
+{
+    size_t k;
+
+    for (k = 0; k < set->nheld && set->held[k].start < bound; k++) {
+        if (lineno > 0)
+            writeint(set->out, lineno, ':');
+        writeint(set->out, set->held[k].start, ' ');
+        writeint(set->out, set->held[k].id, '\n');
+    }
+    memmove(set->held, set->held + k, (set->nheld - k) * sizeof(SetMatch));
+    set->nheld -= k;
+}
+
+/*
+ * setbound: no match the set finds after offset pos can start before
+ * the offset returned: a pattern not running starts at pos + 1 at the
+ * earliest, a running one at its oldest thread or held-back match.
+ */
+static long setbound(const PatternSet *set, long pos)
+{
+    long bound = pos + 1;
+    int j, t;
+
+    for (j = 0; j < set->nactive; j++) {
+        const PikeVM *vm = &set->vms[set->active[j]];
+
+        if (vm->matched && vm->matchstart < bound)
+            bound = vm->matchstart;
+        for (t = 0; t < vm->nc; t++)
+            if (vm->clist[t].start < bound)
+                bound = vm->clist[t].start;
+    }
+    return bound;
+}
+
+/*
+ * runpattern: step pattern i's VM through text offset last.  A match is
+ * settled once no higher-priority thread is left to beat it, and the
+ * search resumes right after it as nextmatch does; if that is behind
+ * last, the VM catches up on its own.  Returns the matches settled,
+ * which are held for scanset to print.
+ */
+long runpattern(PatternSet *set, int i, const char *text, long length, long last)
+{
+    PikeVM *vm = &set->vms[i];
+    long count = 0;
+
+    while (vm->pos <= last) {
+        pikestep(vm, text, length);
+        if (vm->nc > 0)
+            continue;
+        if (vm->matched) {
+            if (vm->matchstart >= length) {
+                set->state[i] = SET_DONE;
+                return count;
+            }
+            holdmatch(set, vm->matchstart, set->ids[i]);
+            count++;
+            pikestart(vm, vm->matchend > vm->matchstart ? vm->matchend : vm->matchstart + 1,
+                      length);
+            if (vm->pos >= length) {
+                set->state[i] = SET_DONE;
+                return count;
+            }
+        } else if (vm->prog->anchored) {
+            set->state[i] = SET_DONE;
+            return count;
+        }
+    }
+    set->state[i] = vm->nc > 0 ? SET_ACTIVE : SET_IDLE;
+    return count;
+}
+
+/*
+ * scanset: print "offset id" (or "line:column id") for each match of each
+ * pattern, ordered by offset and then by id
+ */
+long scanset(void *arg, const char *text, long length, long lineno)
+{
+    PatternSet *set = arg;
+    long pos, count = 0;
+    int i, j, k;
+
+    memset(set->state, SET_IDLE, set->n);
+    set->nactive = 0;
+    for (pos = 0; pos <= length; pos++) {
+        const int *cand[2] = { set->nullable, NULL };
+        int ncand[2] = { set->nnullable, 0 };
+
+        if (pos < length) {
+            cand[1] = set->bybyte[(unsigned char)text[pos]];
+            ncand[1] = set->nbybyte[(unsigned char)text[pos]];
+        }
+        for (k = 0; k < 2; k++) {
+            for (j = 0; j < ncand[k]; j++) {
+                const Prog *prog;
+
+                i = cand[k][j];
+                prog = &set->progs[i];
+                if (set->state[i] != SET_IDLE || (prog->anchored && pos > 0))
+                    continue;
+                if (prog->prefixlen > 0 &&
+                    (length - pos < prog->prefixlen ||
+                     memcmp(text + pos, prog->prefix, prog->prefixlen) != 0))
+                    continue;
+                pikestart(&set->vms[i], pos, length);
+                set->state[i] = SET_ACTIVE;
+                set->active[set->nactive++] = i;
+            }
+        }
+
+        for (j = k = 0; j < set->nactive; j++) {
+            i = set->active[j];
+            count += runpattern(set, i, text, length, pos);
+            if (set->state[i] == SET_ACTIVE)
+                set->active[k++] = i;
         }
-    } while (t-- > text);
+        set->nactive = k;
+        if (set->nheld > 0)
+            printheld(set, setbound(set, pos), lineno);
+    }
+    printheld(set, length + 1, lineno);
+    return count;
+}
+
+
+/*
+ * Benchmark (-B): times match() and the full non-overlapping scan that
+ * findAndPrintMatches does, for every engine, over a fixed corpus of
+ * patterns and synthetic texts from 1 KB up to the size given.  Results
+ * go to stdout as tab-separated lines with a header, one per run, so two
+ * builds can be compared with any table tool.  The engine is forced as
+ * with -e, so backtrack rows time the backtracker at every size.
+ */
+#ifndef BENCH_MIN_SECONDS
+#define BENCH_MIN_SECONDS 0.2
+#endif
+
+typedef struct {
+    const char *category;
+    const char *regexp;
+    int runs;               // text is a run of 'a' ending in 'b' instead of log lines
+} BenchCase;
+
+static const BenchCase benchcases[] = {
+    { "literal", "timeout", 0 },
+    { "literal", "user=admin", 0 },
+    { "literal", "ERROR disk", 0 },
+    { "class", "[0-9]+", 0 },
+    { "class", "[a-z0-9]*@[a-z]+", 0 },
+    { "class", "[^ ]+ ERROR", 0 },
+    { "quantifier", "id=[0-9]*x?y+", 0 },
+    { "quantifier", "u.*n", 0 },
+    { "quantifier", "^.*ERROR", 0 },
+    { "pathological", "a*a*a*a*a*a*a*a*b", 1 },
+    { "pathological", "a?a?a?a?a?a?a?a?aaaaaaaa", 1 },
+    { "pathological", ".*.*.*.*=", 0 },
+};
+
+static const char *benchwords[] = {
+    "INFO", "WARN", "ERROR", "disk", "timeout", "user=admin", "user=guest",
+    "id=4711", "mail@example", "request", "GET", "/index.html", "200", "404",
+};
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * benchtext: length bytes of log-like lines, or of 'a' with a 'b' last,
+ * NUL-terminated; the 'b' gets the pathological patterns past the
+ * required-byte check, so the engines walk the whole run of 'a'
+ */
+char *benchtext(long length, int runs)
+{
+    char *text = malloc(length + 1);
+    unsigned long x = 88172645463325252UL;
+    long pos = 0, linestart = 0;
+
+    if (runs) {
+        memset(text, 'a', length);
+        text[length - 1] = 'b';
+        text[length] = '\0';
+        return text;
+    }
+    while (pos < length) {
+        const char *word;
+        long n;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        word = benchwords[x % (sizeof(benchwords) / sizeof(benchwords[0]))];
+        n = strlen(word);
+        if (pos + n + 1 > length)
+            n = length - pos - 1;
+        memcpy(text + pos, word, n > 0 ? n : 0);
+        pos += n > 0 ? n : 0;
+        if (pos < length) {
+            text[pos] = pos - linestart > 80 ? '\n' : ' ';
+            if (text[pos++] == '\n')
+                linestart = pos;
+        }
+    }
+    text[length] = '\0';
+    return text;
+}
+
+int ignorematch(void *arg, int64_t start, int64_t length)
+{
+    (void)arg;
+    (void)start;
+    (void)length;
     return 0;
 }
 
+/*
+ * benchrun: time one entry point until BENCH_MIN_SECONDS have passed.
+ * match() stops at the first match, so its bytes_per_sec counts only
+ * the text up to the end of that match, the least a search must read.
+ */
+void benchrun(const BenchCase *bc, const Prog *prog, const char *text, long length,
+              int eng, const char *entry)
+{
+    static const char *names[] = { "auto", "pike", "backtrack" };
+    double start, elapsed;
+    long iterations = 0, matches = 0, scanned = length, matchstart, matchend;
+
+    engine = eng;
+    if (entry[0] == 'm') {
+        Matcher m;
+
+        initmatcher(&m, prog);
+        if (search(&m, text, length, 0, length, &matchstart, &matchend))
+            scanned = matchend;
+        freematcher(&m);
+    }
+    start = now();
+    do {
+        Matcher m;
+        int matchlength;
+
+        if (entry[0] == 'm') {
+            matches += match(prog, text, &matchlength);
+        } else {
+            initmatcher(&m, prog);
+            matches += findmatches(&m, text, length, ignorematch, NULL);
+            freematcher(&m);
+        }
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    printf("%s\t%s\t%ld\t%s\t%s\t%ld\t%.9f\t%.0f\t%.0f\n", bc->category, bc->regexp,
+           length, names[eng], entry, iterations, elapsed / iterations,
+           (double)scanned * iterations / elapsed, matches / elapsed);
+    fflush(stdout);
+}
+
+/* bench: run the corpus over texts of 1 KB, 16 KB, ... up to maxbytes */
+void bench(long maxbytes)
+{
+    size_t i;
+    long length;
+    int eng;
+
+    printf("category\tpattern\tbytes\tengine\tentry\titerations\tseconds\tbytes_per_sec\tmatches_per_sec\n");
+    for (length = 1024; length <= maxbytes; length *= 16) {
+        char *texts[2] = { benchtext(length, 0), benchtext(length, 1) };
+
+        for (i = 0; i < sizeof(benchcases) / sizeof(benchcases[0]); i++) {
+            const BenchCase *bc = &benchcases[i];
+            Prog prog;
+
+            compile(bc->regexp, &prog);
+            for (eng = ENGINE_AUTO; eng <= ENGINE_BACKTRACK; eng++) {
+                benchrun(bc, &prog, texts[bc->runs], length, eng, "match");
+                benchrun(bc, &prog, texts[bc->runs], length, eng, "findAndPrintMatches");
+            }
+            freeprog(&prog);
+        }
+        free(texts[0]);
+        free(texts[1]);
+    }
+    engine = ENGINE_AUTO;
+}
+
+
+/*
+ * Code generation (-g): for a pattern fixed at build time, write out C
+ * source for a matcher specialized to it.  Each instruction becomes a
+ * label and straight-line comparisons, with no pattern to parse and no
+ * instruction dispatch at run time.  It backtracks in the same priority
+ * order as the engines here and remembers which (split, offset) pairs it
+ * has tried, so it finds the same matches in O(n*m) time.  The memo costs
+ * one bit per split per text byte and lives in a state struct the caller
+ * passes to every call.  As with BitState, each search clears only the
+ * words the one before it set, so walking a text with <name>_next stays
+ * linear rather than clearing a whole-text bitmap per match.
+ */
+
+/* byteranges: split cls into runs of consecutive bytes; returns how many */
+int byteranges(const CharClass *cls, int ranges[128][2])
+{
+    int nranges = 0, c;
+
+    for (c = 0; c < 256; c++) {
+        if (!inclass(cls, c))
+            continue;
+        if (nranges > 0 && ranges[nranges - 1][1] == c - 1) {
+            ranges[nranges - 1][1] = c;
+        } else {
+            ranges[nranges][0] = ranges[nranges][1] = c;
+            nranges++;
+        }
+    }
+    return nranges;
+}
+
+/*
+ * genbyteset: a C expression testing c against the bytes in cls, a few
+ * comparisons or, for a set with more than four runs, the bitmap name_set<id>
+ */
+void genbyteset(FILE *out, const CharClass *cls, const char *name, int id)
+{
+    int ranges[128][2], nranges = byteranges(cls, ranges), i;
+
+    if (nranges == 0) {
+        fprintf(out, "0");
+    } else if (nranges == 1 && ranges[0][0] == 0 && ranges[0][1] == 255) {
+        fprintf(out, "1");
+    } else if (nranges <= 4) {
+        for (i = 0; i < nranges; i++) {
+            if (i > 0)
+                fprintf(out, " || ");
+            if (ranges[i][0] == ranges[i][1])
+                fprintf(out, "c == %d", ranges[i][0]);
+            else
+                fprintf(out, "(c >= %d && c <= %d)", ranges[i][0], ranges[i][1]);
+        }
+    } else {
+        fprintf(out, "%s_set%d[c >> 3] >> (c & 7) & 1", name, id);
+    }
+}
+
+void gencode(const Prog *prog, const char *regexp, const char *name, FILE *out)
+{
+    int pc, i, nsplits = 0, canfail = 0;
+    int *splitid = malloc(prog->len * sizeof(int));
+    char *target = calloc(prog->len, 1);    // some jump leads to pc, so it needs a label
+
+    for (pc = 0; pc < prog->len; pc++) {
+        const Inst *in = &prog->inst[pc];
+
+        splitid[pc] = in->op == OP_SPLIT ? nsplits++ : -1;
+        if (in->op == OP_SPLIT)
+            target[in->y] = 1;
+        if (in->op == OP_SPLIT || in->op == OP_JMP)
+            target[in->x] = 1;
+        if (in->op != OP_JMP && in->op != OP_MATCH)
+            canfail = 1;
+    }
+
+    // the pattern goes in a comment, so neither "*/" nor "/*" may appear in it as is
+    fprintf(out, "/* generated by a2 -g %s from the pattern: ", name);
+    for (i = 0; regexp[i] != '\0'; i++) {
+        fputc(regexp[i], out);
+        if ((regexp[i] == '*' && regexp[i + 1] == '/') || (regexp[i] == '/' && regexp[i + 1] == '*'))
+            fputc('\\', out);
+    }
+    fprintf(out, " */\n#include <stdlib.h>\n#include <string.h>\n\n");
+    fprintf(out,
+            "/*\n"
+            " * %s_state: what %s_search keeps from one call to the next, so that\n"
+            " * stepping through the matches of a text does not clear a fresh\n"
+            " * bitmap for every match.  Zero it before the first call and release\n"
+            " * it with %s_free.\n"
+            " */\n"
+            "struct %s_state {\n"
+            "    unsigned long long *visited;    /* bit (pos - from) * %d + split */\n"
+            "    size_t nwords;                  /* words allocated */\n"
+            "    size_t dirty;                   /* words the last search may have set */\n"
+            "    struct %s_job { int resume; long pos; } *jobs;\n"
+            "    long jobcap;\n"
+            "};\n\n"
+            "void %s_free(struct %s_state *st)\n"
+            "{\n"
+            "    free(st->visited);\n"
+            "    free(st->jobs);\n"
+            "    st->visited = NULL;\n"
+            "    st->jobs = NULL;\n"
+            "    st->nwords = st->dirty = 0;\n"
+            "    st->jobcap = 0;\n"
+            "}\n",
+            name, name, name, name, nsplits, name, name, name);
+
+    // bitmaps for the classes too large for a few comparisons
+    for (i = 0; i <= prog->nclasses; i++) {
+        const CharClass *cls = i < prog->nclasses ? &prog->classes[i] : &prog->first;
+        int ranges[128][2], k;
+
+        if (byteranges(cls, ranges) <= 4 || (i == prog->nclasses && prog->nullable))
+            continue;
+        fprintf(out, "static const unsigned char %s_set%d[32] = {", name, i);
+        for (k = 0; k < 32; k++)
+            fprintf(out, "%s%d", k ? ", " : " ", cls->bits[k]);
+        fprintf(out, " };\n");
+    }
+
+    fprintf(out,
+            "\n/*\n"
+            " * %s_search: the leftmost match starting in [from, last], as search()\n"
+            " * in a2; -1 if memory ran out\n"
+            " */\n"
+            "int %s_search(struct %s_state *st, const char *text, long length, long from, long last,\n"
+            "        long *matchstart, long *matchend)\n"
+            "{\n"
+            "    const unsigned char *s = (const unsigned char *)text;\n"
+            "    long start, pos;\n"
+            "    int found = 0, c;\n",
+            name, name, name);
+    if (nsplits > 0)
+        fprintf(out,
+                "    size_t need = ((size_t)%d * (length - from + 1)) / 64 + 1, bit;\n"
+                "    unsigned long long *visited;\n"
+                "    struct %s_job *jobs;\n"
+                "    long njobs, jobcap;\n"
+                "\n"
+                "    if (need > st->nwords) {\n"
+                "        free(st->visited);\n"
+                "        st->nwords = st->dirty = 0;\n"
+                "        if ((st->visited = calloc(need, sizeof(*st->visited))) == NULL)\n"
+                "            return -1;\n"
+                "        st->nwords = need;\n"
+                "    } else {\n"
+                "        memset(st->visited, 0, st->dirty * sizeof(*st->visited));\n"
+                "    }\n"
+                "    st->dirty = 0;\n"
+                "    if (st->jobs == NULL) {\n"
+                "        if ((st->jobs = malloc(64 * sizeof(*st->jobs))) == NULL)\n"
+                "            return -1;\n"
+                "        st->jobcap = 64;\n"
+                "    }\n"
+                "    visited = st->visited;\n"
+                "    jobs = st->jobs;\n"
+                "    jobcap = st->jobcap;\n",
+                nsplits, name);
+    else
+        fprintf(out, "\n    (void)st;\n");
+    fprintf(out, "\n    (void)s;\n    (void)c;\n    for (start = from; start <= last && start <= length; start++) {\n");
+    if (prog->anchored)
+        fprintf(out, "        if (start > 0)\n            break;\n");
+    if (prog->prefixlen > 0 && !prog->anchored) {
+        fprintf(out, "        {\n            static const unsigned char prefix[] = {");
+        for (i = 0; i < prog->prefixlen; i++)
+            fprintf(out, "%s%d", i ? ", " : " ", prog->prefix[i]);
+        fprintf(out,
+                " };\n"
+                "            const unsigned char *hit;\n\n"
+                "            for (;;) {\n"
+                "                if (start + %d > length ||\n"
+                "                    (hit = memchr(s + start + %d, %d, length - %d - start + 1)) == NULL)\n"
+                "                    goto done;\n"
+                "                start = hit - s - %d;\n"
+                "                if (memcmp(s + start, prefix, %d) == 0)\n"
+                "                    break;\n"
+                "                start++;\n"
+                "            }\n"
+                "            if (start > last)\n"
+                "                goto done;\n"
+                "        }\n",
+                prog->prefixlen, prog->rareoffset, prog->prefix[prog->rareoffset],
+                prog->prefixlen, prog->rareoffset, prog->prefixlen);
+    }
+    if (!prog->nullable) {
+        fprintf(out, "        if (start == length)\n            break;\n        c = s[start];\n        if (!(");
+        genbyteset(out, &prog->first, name, prog->nclasses);
+        fprintf(out, "))\n            continue;\n");
+    }
+    fprintf(out, nsplits > 0 ? "        pos = start;\n        njobs = 0;\n" : "        pos = start;\n");
+
+    for (pc = 0; pc < prog->len; pc++) {
+        const Inst *in = &prog->inst[pc];
+
+        if (target[pc])
+            fprintf(out, "    L%d:\n", pc);
+        switch (in->op) {
+        case OP_CHAR:
+            fprintf(out, "        if (pos >= length || s[pos] != %d)\n            goto fail;\n"
+                         "        pos++;\n", in->x);
+            break;
+        case OP_ANY:
+            fprintf(out, "        if (pos >= length)\n            goto fail;\n        pos++;\n");
+            break;
+        case OP_CLASS:
+            fprintf(out, "        if (pos >= length)\n            goto fail;\n"
+                         "        c = s[pos];\n        if (!(");
+            genbyteset(out, &prog->classes[in->x], name, in->x);
+            fprintf(out, "))\n            goto fail;\n        pos++;\n");
+            break;
+        case OP_SPLIT:
+            fprintf(out,
+                    "        bit = (size_t)(pos - from) * %d + %d;\n"
+                    "        if (visited[bit / 64] >> (bit %% 64) & 1)\n"
+                    "            goto fail;\n"
+                    "        visited[bit / 64] |= 1ULL << (bit %% 64);\n"
+                    "        if (bit / 64 >= st->dirty)\n"
+                    "            st->dirty = bit / 64 + 1;\n"
+                    "        if (njobs == jobcap) {\n"
+                    "            struct %s_job *grown = realloc(jobs, 2 * jobcap * sizeof(*jobs));\n"
+                    "\n"
+                    "            if (grown == NULL) {\n"
+                    "                found = -1;\n"
+                    "                goto done;\n"
+                    "            }\n"
+                    "            jobs = st->jobs = grown;\n"
+                    "            jobcap = st->jobcap = 2 * jobcap;\n"
+                    "        }\n"
+                    "        jobs[njobs].resume = %d;\n"
+                    "        jobs[njobs++].pos = pos;\n"
+                    "        goto L%d;\n",
+                    nsplits, splitid[pc], name, in->y, in->x);
+            break;
+        case OP_JMP:
+            fprintf(out, "        goto L%d;\n", in->x);
+            break;
+        case OP_EOL:
+            fprintf(out, "        if (pos != length)\n            goto fail;\n");
+            break;
+        case OP_MATCH:
+            fprintf(out, "        *matchstart = start;\n        *matchend = pos;\n"
+                         "        found = 1;\n        goto done;\n");
+            break;
+        }
+    }
+    if (canfail && nsplits == 0)
+        fprintf(out, "    fail:\n        ;\n");
+    if (nsplits > 0)
+        fprintf(out, "    fail:\n        if (njobs == 0)\n            continue;\n"
+                     "        pos = jobs[--njobs].pos;\n        switch (jobs[njobs].resume) {\n");
+    for (pc = 0; pc < prog->len; pc++) {
+        int y = prog->inst[pc].y, k;
+
+        if (prog->inst[pc].op != OP_SPLIT)
+            continue;
+        for (k = 0; k < pc; k++)
+            if (prog->inst[k].op == OP_SPLIT && prog->inst[k].y == y)
+                break;
+        if (k == pc)
+            fprintf(out, "        case %d:\n            goto L%d;\n", y, y);
+    }
+    if (nsplits > 0)
+        fprintf(out, "        }\n    }\ndone:\n    return found;\n}\n");
+    else
+        fprintf(out, "    }\ndone:\n    return found;\n}\n");
+
+    fprintf(out,
+            "\n/*\n"
+            " * %s_next: the next non-overlapping match at or after *from, as\n"
+            " * nextmatch() in a2; -1 if memory ran out\n"
+            " */\n"
+            "int %s_next(struct %s_state *st, const char *text, long length, long *from,\n"
+            "        long *matchstart, long *matchend)\n"
+            "{\n"
+            "    int found;\n"
+            "\n"
+            "    if (*from >= length)\n"
+            "        return 0;\n"
+            "    found = %s_search(st, text, length, *from, length, matchstart, matchend);\n"
+            "    if (found <= 0 || *matchstart >= length)\n"
+            "        return found < 0 ? -1 : 0;\n"
+            "    *from = *matchend > *matchstart ? *matchend : *matchstart + 1;\n"
+            "    return 1;\n"
+            "}\n", name, name, name, name);
+    free(splitid);
+    free(target);
+}
+
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <input_filename>\n", argv[0]);
+    int scan = 0, bylines = 0, threads = 1, opt;
+    char *patterns = NULL, *generate = NULL, *unit;
+    long benchbytes = 0;
+
+    while ((opt = getopt(argc, argv, "slp:e:j:B:g:")) != -1) {
+        switch (opt) {
+        case 'g':
+            generate = optarg;
+            break;
+        case 'B':
+            benchbytes = strtol(optarg, &unit, 10);
+            if (*unit == 'k' || *unit == 'K')
+                benchbytes <<= 10;
+            else if (*unit == 'm' || *unit == 'M')
+                benchbytes <<= 20;
+            else if (*unit == 'g' || *unit == 'G')
+                benchbytes <<= 30;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads <= 0)
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'e':
+            if (strcmp(optarg, "pike") == 0)
+                engine = ENGINE_PIKE;
+            else if (strcmp(optarg, "backtrack") == 0)
+                engine = ENGINE_BACKTRACK;
+            else if (strcmp(optarg, "auto") != 0)
+                argc = 0;
+            break;
+        case 's':
+            scan = 1;
+            break;
+        case 'p':
+            patterns = optarg;
+            break;
+        case 'l':
+            bylines = 1;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (benchbytes > 0 && argc == optind) {
+        bench(benchbytes);
+        return 0;
+    }
+    if (generate != NULL && argc - optind == 1) {
+        // C source for a matcher specialized to the pattern, to build into a program
+        Prog prog;
+
+        compile(argv[optind], &prog);
+        gencode(&prog, argv[optind], generate, stdout);
+        freeprog(&prog);
+        return 0;
+    }
+    if (patterns != NULL ? scan || argc - optind != 1 :
+        scan ? argc - optind != 2 : argc - optind != 1 || bylines) {
+        fprintf(stderr, "Usage: %s [-e engine] <input_filename>\n", argv[0]);
+        fprintf(stderr, "       %s [-e engine] -s [-l] [-j threads] <regexp> <file>\n", argv[0]);
+        fprintf(stderr, "       %s -p <patterns_file> [-l] <file>\n", argv[0]);
+        fprintf(stderr, "       %s -B <max_text_bytes>[k|M|G]\n", argv[0]);
+        fprintf(stderr, "       %s -g <name> <regexp>\n", argv[0]);
+        fprintf(stderr, "engine: auto (default), pike or backtrack, which needs a bit\n"
+                        "        per byte of text for each instruction of the pattern\n");
         return 1;
     }
 
-    FILE *file = fopen(argv[1], "r");
+    if (scan) {
+        // grep-style: offsets of every match in an arbitrarily large file
+        Prog prog;
+        Writer out;
+        long count;
+
+        compile(argv[optind], &prog);
+        initwriter(&out, stdout);
+        if (threads > 1) {
+            ParallelScan job = { .prog = &prog, .threads = threads, .bylines = bylines, .out = &out };
+
+            count = scanfile(argv[optind + 1], 0, scanparallel, &job);
+        } else {
+            TextScan ts = { .out = &out };
+
+            initmatcher(&ts.m, &prog);
+            count = scanfile(argv[optind + 1], bylines, scantext, &ts);
+            freematcher(&ts.m);
+        }
+        freewriter(&out);
+        freeprog(&prog);
+        return count > 0 ? 0 : count == 0 ? 1 : 2;
+    }
+
+    if (patterns != NULL) {
+        // a whole ruleset in one pass; each match is tagged with its pattern's line
+        PatternSet set;
+        Writer out;
+        long count;
+
+        if (loadpatternset(patterns, &set) < 0)
+            return 2;
+        initwriter(&out, stdout);
+        set.out = &out;
+        count = scanfile(argv[optind], bylines, scanset, &set);
+        freewriter(&out);
+        freepatternset(&set);
+        return count > 0 ? 0 : count == 0 ? 1 : 2;
+    }
+
+    FILE *file = fopen(argv[optind], "r");
     if (file == NULL) {
         perror("Error opening the file");
         return 1;
@@ -179,19 +2028,15 @@ int main(int argc, char *argv[]) {
     }
     //printf("%s %s", regexp, text);
     fclose(file);
-//    int matchedLengthTest = 0;
-//    int defaultResult = match(regexp, text, &matchedLengthTest); // this is obtained using original function from Rob Pike code, testing purpose
-//    //printf("%d %d\n", defaultResult, matchedLengthTest);
 
+    Prog prog;
+    Writer out;
+    compile(regexp, &prog);
 
-    int matchesFound[1000], noOfMatches = 0;
-    findAndPrintMatches(regexp, text, matchesFound, &noOfMatches);
-    if(noOfMatches > 0) {
-        printf("match");
-        for (int i = 1; i <= noOfMatches; i++)
-            printf(" %d", matchesFound[i]);
-    }
-    else printf("no match");
+    initwriter(&out, stdout);
+    findAndPrintMatches(&prog, text, strlen(text), &out);
+    freewriter(&out);
+    freeprog(&prog);
 
     return 0;
 }
@@ -7,69 +7,477 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifndef NOGRAPHICS
 #include <ncurses.h>
+#endif
 
 #define SCREENSIZE 150
+// number of expressions a batch thread takes at a time
+#define BATCH_CHUNK 256
+// most nodes a parse tree may hold, without packrat parsing every retried
+// parse stays in the tree, so it doubles with each level of nesting
+#define MAX_NODES (1 << 22)
+// deepest the parse tree may go, each level is a recursive call, so this
+// keeps a deeply nested expression within the default 8 MB stack
+#define MAX_DEPTH 10000
+
+// kinds of parse tree nodes, one for each label in the drawn tree
+// the rules come first, their kinds index the packrat table
+enum
+{
+    NODE_REGEXP,
+    NODE_CONCAT,
+    NODE_TERM,
+    NODE_STAR,
+    NODE_ELEMENT,
+    NODE_GROUP,
+    NODE_CHAR,
+    NODE_EOLN,
+    RULES = NODE_EOLN + 1,
+    NODE_MATCH = RULES,
+    NODE_FAIL
+};
+
+const char *nodeLabels[] = {"regexp", "concat", "term", "star", "element",
+                            "group", "char", "eoln", "match", "fail"};
+
+// a node in the parse tree
+// nodes are stored in one contiguous array and refer to each other by
+// index, -1 means there is no such node
+typedef struct
+{
+    int kind;
+    // position in the string when the node was created
+    int position;
+    int parent;
+    // first child and next sibling
+    int child;
+    int sibling;
+} Node;
+
+// arena holding all nodes of a parse tree, the root is node 0
+typedef struct
+{
+    Node *nodes;
+    int count;
+    int capacity;
+    // most recent node created at each depth, used to find the parent
+    // and previous sibling of a new node
+    int *open;
+    int depths;
+} Tree;
+
+// result of a rule at one position, remembered in packrat mode
+typedef struct
+{
+    int result;
+    // position after the rule
+    int end;
+    // node added by the rule, -1 if the rule has not run here yet
+    int node;
+} Memo;
+
+// state of a parse, passed to every rule function
+// each thread has its own, so any number of parses can run at once
+typedef struct
+{
+    // current position in string
+    int position;
+    // parse tree built by the rule functions
+    Tree tree;
+    // packrat parsing, each rule runs at most once at each position
+    int packrat;
+    // RULES rows of memoLength entries, one for each position in the string
+    Memo *memo;
+    int memoLength;
+    // why the parse was given up, NULL if it was not
+    const char *error;
+} Parser;
+
+// expressions parsed by a pool of threads
+typedef struct
+{
+    char **lines;
+    int count;
+    // 1 if the expression parsed, 0 if not
+    char *results;
+    int packrat;
+    // first expression no thread has taken yet
+    atomic_int next;
+} Batch;
+
+int regexp(Parser *, char *, int);
+int concat(Parser *, char *, int);
+int term(Parser *, char *, int);
+int star(Parser *, char *, int);
+int element(Parser *, char *, int);
+int group(Parser *, char *, int);
+int character(Parser *, char *, int);
+int symbol(Parser *, char *, int);
+int alphanum(Parser *, char *, int);
+int metachar(Parser *, char *, int);
+int white(Parser *, char *, int);
+int tab(Parser *, char *, int);
+int vtab(Parser *, char *, int);
+int nline(Parser *, char *, int);
+int endofline(Parser *, char *, int);
+int parseRegexp(Parser *, char *, int);
+int parseConcat(Parser *, char *, int);
+int parseTerm(Parser *, char *, int);
+int parseStar(Parser *, char *, int);
+int parseElement(Parser *, char *, int);
+int parseGroup(Parser *, char *, int);
+int parseCharacter(Parser *, char *, int);
+int parseEndofline(Parser *, char *, int);
+
+// appends a node at the given depth to the parse tree and links it
+// under the most recent node one level up
+int addNode(Parser *parser, int depth, int kind)
+{
+    Tree *tree = &parser->tree;
+
+    if (tree->count == tree->capacity)
+    {
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 256;
+        tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(Node));
+        if (tree->nodes == NULL)
+        {
+            perror("Error allocating parse tree");
+            exit(1);
+        }
+    }
+    if (depth >= tree->depths)
+    {
+        tree->depths = depth * 2 + 16;
+        tree->open = realloc(tree->open, tree->depths * sizeof(int));
+        if (tree->open == NULL)
+        {
+            perror("Error allocating parse tree");
+            exit(1);
+        }
+    }
 
-// current position in string
-int position;
-// indentation
-int width;
-
-int regexp(char *, int);
-int concat(char *, int);
-int term(char *, int);
-int star(char *, int);
-int element(char *, int);
-int group(char *, int);
-int character(char *, int);
-int symbol(char *, int);
-int alphanum(char *, int);
-int metachar(char *, int);
-int white(char *, int);
-int tab(char *, int);
-int vtab(char *, int);
-int nline(char *, int);
-int endofline(char *, int);
+    const int index = tree->count++;
+    Node *node = &tree->nodes[index];
+    node->kind = kind;
+    node->position = parser->position;
+    node->parent = depth > 0 ? tree->open[depth - 1] : -1;
+    node->child = -1;
+    node->sibling = -1;
 
-// draws text on screen at location (depth, width) using ncurses
-void print(int depth, char *str)
+    if (node->parent >= 0)
+    {
+        // the last node at this depth is the previous sibling if there
+        // is one, nodes are added in the order they are drawn
+        if (tree->nodes[node->parent].child < 0)
+            tree->nodes[node->parent].child = index;
+        else
+            tree->nodes[tree->open[depth]].sibling = index;
+    }
+    tree->open[depth] = index;
+    return index;
+}
+
+// prepares to parse a new string, the tree and packrat table are emptied
+// without releasing their memory so they can be reused
+void resetParse(Parser *parser, char *regex)
+{
+    parser->tree.count = 0;
+    parser->position = 0;
+    parser->error = NULL;
+    if (!parser->packrat)
+        return;
+
+    parser->memoLength = strlen(regex) + 1;
+    parser->memo = realloc(parser->memo, RULES * parser->memoLength * sizeof(Memo));
+    if (parser->memo == NULL)
+    {
+        perror("Error allocating packrat table");
+        exit(1);
+    }
+    for (int i = 0; i < RULES * parser->memoLength; i++)
+        parser->memo[i].node = -1;
+}
+
+// releases the memory held by a parser
+void freeParser(Parser *parser)
+{
+    free(parser->tree.nodes);
+    free(parser->tree.open);
+    free(parser->memo);
+}
+
+// runs a rule, in packrat mode a rule that already ran at this position
+// is not parsed again, its node is added once more sharing the children
+// of the first one and the position moves to where it ended
+// once the parse is given up every rule fails, so the parse unwinds
+// without adding more than a few nodes
+int rule(Parser *parser, int kind, int (*parse)(Parser *, char *, int), char *regex, int depth)
+{
+    if (parser->error == NULL && parser->tree.count >= MAX_NODES)
+        parser->error = "parse tree too large";
+    if (parser->error == NULL && depth > MAX_DEPTH)
+        parser->error = "expression nested too deeply";
+    if (parser->error != NULL)
+        return 0;
+    if (!parser->packrat)
+        return parse(parser, regex, depth);
+
+    Memo *m = &parser->memo[kind * parser->memoLength + parser->position];
+    if (m->node >= 0)
+    {
+        const int node = addNode(parser, depth, kind);
+        parser->tree.nodes[node].child = parser->tree.nodes[m->node].child;
+        parser->position = m->end;
+        return m->result;
+    }
+
+    // the rule adds its own node first
+    const int node = parser->tree.count;
+    const int result = parse(parser, regex, depth);
+    m->result = result;
+    m->end = parser->position;
+    m->node = node;
+    return result;
+}
+
+int regexp(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_REGEXP, parseRegexp, regex, depth);
+}
+
+int concat(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_CONCAT, parseConcat, regex, depth);
+}
+
+int term(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_TERM, parseTerm, regex, depth);
+}
+
+int star(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_STAR, parseStar, regex, depth);
+}
+
+int element(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_ELEMENT, parseElement, regex, depth);
+}
+
+int group(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_GROUP, parseGroup, regex, depth);
+}
+
+int character(Parser *parser, char *regex, int depth)
+{
+    return rule(parser, NODE_CHAR, parseCharacter, regex, depth);
+}
+
+int endofline(Parser *parser, char *regex, int depth)
 {
+    return rule(parser, NODE_EOLN, parseEndofline, regex, depth);
+}
+
+// returns the node whose children a packrat copy shares, or -1 if the
+// node owns its children
+// the shared children keep the first node as their parent
+int sharedWith(const Tree *tree, int index)
+{
+    const int child = tree->nodes[index].child;
+
+    if (child < 0 || tree->nodes[child].parent == index)
+        return -1;
+    return tree->nodes[child].parent;
+}
+
+// writes a node, its siblings and their subtrees as indented text,
+// one node per line
+// nodes are written in the order they were added, so node i is on line
+// i + 1, a packrat copy refers to that line instead of writing the
+// shared subtree again, which would double the output with each level
+// of nesting
+void writeTree(FILE *out, const Tree *tree, int index, int depth)
+{
+    for (; index >= 0; index = tree->nodes[index].sibling)
+    {
+        const char *label = nodeLabels[tree->nodes[index].kind];
+        const int shared = sharedWith(tree, index);
+
+        if (shared >= 0)
+        {
+            fprintf(out, "%*s%s (as on line %d)\n", depth * 2, "", label, shared + 1);
+            continue;
+        }
+        fprintf(out, "%*s%s\n", depth * 2, "", label);
+        writeTree(out, tree, tree->nodes[index].child, depth + 1);
+    }
+}
+
+// parses the expressions of a batch, one chunk at a time
+// each thread parses into its own tree and packrat table
+void *batchWorker(void *arg)
+{
+    Batch *batch = arg;
+    Parser parser = {0};
+    int first;
+
+    parser.packrat = batch->packrat;
+    while ((first = atomic_fetch_add(&batch->next, BATCH_CHUNK)) < batch->count)
+    {
+        const int last = first + BATCH_CHUNK < batch->count ? first + BATCH_CHUNK : batch->count;
+        for (int i = first; i < last; i++)
+        {
+            resetParse(&parser, batch->lines[i]);
+            batch->results[i] = regexp(&parser, batch->lines[i], 0) && parser.error == NULL;
+        }
+    }
+    freeParser(&parser);
+    return NULL;
+}
+
+// parses every line of the file as an expression on the given number of
+// threads and writes match or fail for each line, in order
+// only the results are kept, so the batch always uses packrat parsing
+// returns the number of lines that did not parse
+int parseBatch(FILE *file, int threads)
+{
+    Batch batch = {0};
+    char *text;
+    long size;
+
+    // read the whole file and split it into lines in place
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    text = malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, file) != (size_t)size)
+    {
+        perror("Error reading expressions");
+        free(text);
+        return -1;
+    }
+    text[size] = '\0';
+
+    int capacity = 1024;
+    batch.lines = malloc(capacity * sizeof(char *));
+    for (char *line = text; line < text + size;)
+    {
+        char *end = memchr(line, '\n', text + size - line);
+        if (end == NULL)
+            end = text + size;
+        *end = '\0';
+        if (batch.count == capacity)
+        {
+            capacity *= 2;
+            batch.lines = realloc(batch.lines, capacity * sizeof(char *));
+        }
+        batch.lines[batch.count++] = line;
+        line = end + 1;
+    }
+    batch.results = malloc(batch.count + 1);
+    batch.packrat = 1;
+    atomic_init(&batch.next, 0);
+
+    // batchWorker runs here as well, the lines it takes from batch.next are
+    // parsed whether or not the other threads could be started
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 1; t < threads; t++)
+        if (pthread_create(&pool[started], NULL, batchWorker, &batch) == 0)
+            started++;
+    batchWorker(&batch);
+    for (int t = 0; t < started; t++)
+        pthread_join(pool[t], NULL);
+
+    int failed = 0;
+    for (int i = 0; i < batch.count; i++)
+    {
+        fputs(batch.results[i] ? "match\n" : "fail\n", stdout);
+        failed += !batch.results[i];
+    }
+
+    free(pool);
+    free(batch.results);
+    free(batch.lines);
+    free(text);
+    return failed;
+}
+
+#ifndef NOGRAPHICS
+// where the next text is drawn on the screen
+typedef struct
+{
+    // indentation
+    int width;
     // offset in depth, used to break line and move it down the screen
     // when the max line length is reached
-    static int offset = 0;
+    int offset;
+} Layout;
 
+// draws text on screen at location (depth, width) using ncurses
+void print(Layout *layout, int depth, char *str)
+{
     // if the output reaches the max width of the window then
     // move down and back to the left edge (carriage return and newline)
-    if (width > SCREENSIZE)
+    if (layout->width > SCREENSIZE)
     {
-        width = 0;
-        offset += 15;
+        layout->width = 0;
+        layout->offset += 15;
     }
     // ncurses command to draw textstr
-    mvprintw(depth + offset, width, str);
+    mvprintw(depth + layout->offset, layout->width, str);
+}
+
+// draws a node and its subtree
+// a packrat copy is drawn without the subtree it shares, which is
+// already on screen under the first node
+void drawNode(Layout *layout, const Tree *tree, int index, int depth)
+{
+    const Node *node = &tree->nodes[index];
+    const int shared = sharedWith(tree, index) >= 0;
+    char label[16];
+
+    // each character moves the output 10 columns to the right before it
+    // is drawn and again after its result
+    if (node->kind == NODE_CHAR)
+        layout->width += 10;
+    snprintf(label, sizeof(label), shared ? "%s..." : "%s", nodeLabels[node->kind]);
+    print(layout, depth, label);
+    for (int child = shared ? -1 : node->child; child >= 0; child = tree->nodes[child].sibling)
+        drawNode(layout, tree, child, depth + 1);
+    if (node->kind == NODE_CHAR || (node->kind == NODE_EOLN && node->child >= 0))
+        layout->width += 10;
 }
 
-int drawTree(char *regex)
+int drawTree(Parser *parser, char *regex)
 {
     char c;
     int depth = 0;
 
     // start in leftmost position
-    width = 0;
-
-    // ncurses clear screen
-    clear();
-    position = 0;
-    regexp(regex, depth);
+    Layout layout = {0, 0};
 
-    refresh();
     // parse tree
-    // parsing functions calls print to draw output
+    // parsing functions add nodes to the tree, which is drawn afterwards
     // -regex is the string containing the regular expression to be parsed
     // -depth contains the current depth in the parse tree, it is
     //    incremented with each recursive call
+    resetParse(parser, regex);
+    regexp(parser, regex, depth);
+    if (parser->error != NULL)
+        return 0;
+
+    // ncurses clear screen
+    clear();
+    drawNode(&layout, &parser->tree, 0, depth);
+    refresh();
 
     // read keyboard and exit if 'q' pressed
     while (1)
@@ -79,30 +487,31 @@ int drawTree(char *regex)
             return (1);
     }
 }
+#endif
 
-int star(char *regex, int depth)
+int parseStar(Parser *parser, char *regex, int depth)
 {
-    print(depth, "star");
-    if (element(regex, depth + 1))
+    addNode(parser, depth, NODE_STAR);
+    if (element(parser, regex, depth + 1))
     {
-        if (regex[position] == '*')
+        if (regex[parser->position] == '*')
         {
-            position++;
+            parser->position++;
             return 1;
         }
     }
     return 0;
 }
 
-int element(char *regex, int depth)
+int parseElement(Parser *parser, char *regex, int depth)
 {
-    print(depth, "element");
-    const int lastPos = position;
-    if (group(regex, depth + 1))
+    addNode(parser, depth, NODE_ELEMENT);
+    const int lastPos = parser->position;
+    if (group(parser, regex, depth + 1))
     {
         return 1;
     }
-    else if ((width += 10) && character(regex, depth + 1))
+    else if (character(parser, regex, depth + 1))
     {
         return 1;
     }
@@ -110,26 +519,26 @@ int element(char *regex, int depth)
         return 0;
 }
 
-int group(char *regex, int depth)
+int parseGroup(Parser *parser, char *regex, int depth)
 {
-    print(depth, "group");
-    if (regex[position] == '(')
+    addNode(parser, depth, NODE_GROUP);
+    if (regex[parser->position] == '(')
     {
-        position++;
-        if (regexp(regex, depth + 1))
+        parser->position++;
+        if (regexp(parser, regex, depth + 1))
         {
-            if (regex[position] == ')')
+            if (regex[parser->position] == ')')
             {
-                position++;
-                print(depth + 1, "match");
+                parser->position++;
+                addNode(parser, depth + 1, NODE_MATCH);
                 return 1;
             }
         }
         else
         {
-            if (regex[position] == ')')
+            if (regex[parser->position] == ')')
             {
-                position++;
+                parser->position++;
 
                 return 0;
             }
@@ -137,23 +546,23 @@ int group(char *regex, int depth)
 
         return 0;
     }
-    print(depth + 1, "fail");
+    addNode(parser, depth + 1, NODE_FAIL);
     return 0;
 }
 
-int term(char *regex, int depth)
+int parseTerm(Parser *parser, char *regex, int depth)
 {
-    print(depth, "term");
-    const int lastPos = position;
+    addNode(parser, depth, NODE_TERM);
+    const int lastPos = parser->position;
 
-    if (star(regex, depth + 1))
+    if (star(parser, regex, depth + 1))
     {
         return 1;
     }
     else
     {
-        position = lastPos;
-        if (element(regex, depth + 1))
+        parser->position = lastPos;
+        if (element(parser, regex, depth + 1))
             return 1;
         else
         {
@@ -162,24 +571,25 @@ int term(char *regex, int depth)
     }
 }
 
-int concat(char *regex, int depth)
+int parseConcat(Parser *parser, char *regex, int depth)
 {
-    print(depth, "concat");
+    addNode(parser, depth, NODE_CONCAT);
 
-        const int lastPos = position;
-    if (term(regex, depth + 1))
+        const int lastPos = parser->position;
+    if (term(parser, regex, depth + 1))
     {
-        if (concat(regex, depth + 1))
+        if (concat(parser, regex, depth + 1))
             return 1;
+        return 0;
     }
     else
     {
-        position = lastPos;
-        if (term(regex, depth + 1))
+        parser->position = lastPos;
+        if (term(parser, regex, depth + 1))
         {
             return 1;
         }
-        else if (endofline(regex, depth + 1))
+        else if (endofline(parser, regex, depth + 1))
         {
 
             return 1;
@@ -191,53 +601,49 @@ int concat(char *regex, int depth)
         }
     }
 }
-int character(char *regex, int depth)
+int parseCharacter(Parser *parser, char *regex, int depth)
 {
-    print(depth, "char");
-    if (alphanum(regex, depth + 1))
+    addNode(parser, depth, NODE_CHAR);
+    if (alphanum(parser, regex, depth + 1))
     {
-        print(depth + 1, "match");
-        width += 10;
+        addNode(parser, depth + 1, NODE_MATCH);
         return 1;
     }
-    else if (symbol(regex, depth + 1))
+    else if (symbol(parser, regex, depth + 1))
     {
-        print(depth + 1, "match");
-        width += 10;
+        addNode(parser, depth + 1, NODE_MATCH);
         return 1;
     }
-    else if (white(regex, depth + 1))
+    else if (white(parser, regex, depth + 1))
     {
 
-        print(depth + 1, "match");
-        width += 10;
+        addNode(parser, depth + 1, NODE_MATCH);
         return 1;
     }
     else
     {
-        print(depth + 1, "fail");
-        width += 10;
+        addNode(parser, depth + 1, NODE_FAIL);
         return 0;
     }
 }
 
-int alphanum(char *regex, int depth)
+int alphanum(Parser *parser, char *regex, int depth)
 {
-    char current = regex[position];
+    char current = regex[parser->position];
     if ((current >= 'A' && current <= 'Z') || (current >= 'a' && current <= 'z') || (current >= '0' && current <= '9'))
     {
-        position++;
+        parser->position++;
         return 1;
     }
     return 0;
 }
 
-int symbol(char *regex, int depth)
+int symbol(Parser *parser, char *regex, int depth)
 {
-    char current = regex[position];
+    char current = regex[parser->position];
     if (current == 0)
     {
-        print(depth, "fail");
+        addNode(parser, depth, NODE_FAIL);
         return 0;
     }
 
@@ -246,75 +652,73 @@ int symbol(char *regex, int depth)
     if (strchr(symbols, current) != NULL)
     {
 
-        position++;
+        parser->position++;
         return 1;
     }
-    print(depth, "fail");
+    addNode(parser, depth, NODE_FAIL);
     return 0;
 }
 
-int white(char *regex, int depth)
+int white(Parser *parser, char *regex, int depth)
 {
-    if (tab(regex, depth + 1) || vtab(regex, depth + 1) || nline(regex, depth + 1))
+    if (tab(parser, regex, depth + 1) || vtab(parser, regex, depth + 1) || nline(parser, regex, depth + 1))
         return 1;
     else
         return 0;
 }
 
-int tab(char *regex, int depth)
+int tab(Parser *parser, char *regex, int depth)
 {
-    if (regex[position] == '\t')
+    if (regex[parser->position] == '\t')
     {
-        position++;
+        parser->position++;
         return 1;
     }
     return 0;
 }
 
-int vtab(char *regex, int depth)
+int vtab(Parser *parser, char *regex, int depth)
 {
-    if (regex[position] == '\v')
+    if (regex[parser->position] == '\v')
     {
 
-        position++;
+        parser->position++;
         return 1;
     }
     return 0;
 }
 
-int nline(char *regex, int depth)
+int nline(Parser *parser, char *regex, int depth)
 {
-    if (regex[position] == '\n')
+    if (regex[parser->position] == '\n')
     {
-        position++;
+        parser->position++;
         return 1;
     }
     return 0;
 }
 
-int endofline(char *regex, int depth)
+int parseEndofline(Parser *parser, char *regex, int depth)
 {
-    print(depth, "eoln");
+    addNode(parser, depth, NODE_EOLN);
 
-    if (regex[position] == '\0')
+    if (regex[parser->position] == '\0')
     {
-        print(depth + 1, "match");
-        width += 10;
+        addNode(parser, depth + 1, NODE_MATCH);
         return 1;
     }
-    else if (regex[position] == ')')
+    else if (regex[parser->position] == ')')
     {
-        print(depth + 1, "fail");
-        width += 10;
+        addNode(parser, depth + 1, NODE_FAIL);
         return 1;
     }
     return 0;
 }
 
-int regexp(char *regex, int depth)
+int parseRegexp(Parser *parser, char *regex, int depth)
 {
-    print(depth, "regexp");
-    if (concat(regex, depth + 1))
+    addNode(parser, depth, NODE_REGEXP);
+    if (concat(parser, regex, depth + 1))
     {
         return (1);
     }
@@ -326,18 +730,51 @@ int regexp(char *regex, int depth)
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    Parser parser = {0};
+    int batch = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    // -p selects packrat parsing
+    // -b parses every line of the file on a pool of -j threads
+    while ((opt = getopt(argc, argv, "pbj:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <input_filename>\n", argv[0]);
+        switch (opt)
+        {
+        case 'p':
+            parser.packrat = 1;
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads <= 0)
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind != 1)
+    {
+        fprintf(stderr, "Usage: %s [-p] <input_filename>\n", argv[0]);
+        fprintf(stderr, "       %s -b [-j threads] <expressions_file>\n", argv[0]);
         return 1;
     }
 
-    FILE *file = fopen(argv[1], "r");
+    FILE *file = fopen(argv[optind], "r");
     if (file == NULL)
     {
         perror("Error opening the file");
         return 1;
     }
+    if (batch)
+    {
+        const int failed = parseBatch(file, threads);
+        fclose(file);
+        return failed != 0;
+    }
     char *ptr = malloc(1000);
     // Use fscanf to read regular expression and text from the file
     if (fscanf(file, "%s", &ptr[0]) != 1)
@@ -346,7 +783,9 @@ int main(int argc, char *argv[])
         fclose(file);
         return 1;
     }
+    fclose(file);
 
+#ifndef NOGRAPHICS
     // initialize ncurses
     initscr();
     noecho();
@@ -358,9 +797,25 @@ int main(int argc, char *argv[])
     // from the input file - do this before calling drawTree()
 
     // traverse and draw the parse tree
-    position = 0;
-    drawTree(ptr);
+    drawTree(&parser, ptr);
 
     // shut down ncurses
     endwin();
+#else
+    // without a terminal, parse and write the tree as text
+    resetParse(&parser, ptr);
+    const int result = regexp(&parser, ptr, 0);
+    if (parser.error == NULL)
+        writeTree(stdout, &parser.tree, 0, 0);
+#endif
+    if (parser.error != NULL)
+        fprintf(stderr, "Error parsing the expression: %s%s\n", parser.error,
+                parser.packrat ? "" : ", try -p");
+#ifdef NOGRAPHICS
+    freeParser(&parser);
+    free(ptr);
+    return result && parser.error == NULL ? 0 : 1;
+#else
+    return parser.error != NULL;
+#endif
 }